@@ -0,0 +1,446 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Allocator benchmarks. The same file is built twice: against this allocator
+   and, with -DBENCH_GLIBC, against glibc malloc, so both run identical code.
+   Each (workload, thread count) pair runs in a forked child so its peak RSS
+   is measured on its own. */
+
+#ifdef BENCH_GLIBC
+#define ALLOCATOR "glibc"
+#define bench_alloc malloc
+#define bench_free free
+#define bench_resize realloc
+#else
+#include "memory_allocator.h"
+#define ALLOCATOR "memalloc"
+#define bench_alloc memalloc
+#define bench_free memfree
+#define bench_resize memresize
+#endif
+
+#define SAMPLE_EVERY 16         // one op in this many is timed for the latency percentiles
+#define MAX_SAMPLES (1 << 16)   // per thread
+#define MAX_THREADS 64
+
+typedef struct worker {
+    pthread_t thread;
+    int id;
+    int nthreads;
+    unsigned seed;
+    uint64_t ops;
+    uint32_t* samples;          // latencies in ns
+    size_t nsamples;
+    uint64_t tick;
+} worker;
+
+typedef struct workload {
+    const char* name;
+    void (*run)(worker* w);
+    void (*setup)(int nthreads);
+} workload;
+
+static long scale = 1;          // multiplies every workload's op count
+
+//helper function to read a monotonic clock in nanoseconds
+static inline uint64_t now_ns(void)
+{
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+
+}
+
+//helper function for a per-thread xorshift random number
+static inline unsigned rnd(worker* w)
+{
+
+    unsigned x = w->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return w->seed = x;
+
+}
+
+//helper function to time one op in SAMPLE_EVERY
+static inline uint64_t sample_start(worker* w)
+{
+    return (++w->tick % SAMPLE_EVERY == 0) ? now_ns() : 0;
+}
+
+static inline void sample_end(worker* w, uint64_t start)
+{
+
+    w->ops++;
+    if (start && w->nsamples < MAX_SAMPLES)
+        w->samples[w->nsamples++] = (uint32_t)(now_ns() - start);
+
+}
+
+static inline void* timed_alloc(worker* w, size_t size)
+{
+
+    uint64_t t = sample_start(w);
+    void* p = bench_alloc(size);
+    sample_end(w, t);
+    if (!p) {
+        fprintf(stderr, "allocation of %zu bytes failed\n", size);
+        exit(1);
+    }
+    *(volatile char*)p = 1; // touch it, as a real user would
+    return p;
+
+}
+
+static inline void timed_free(worker* w, void* p)
+{
+
+    uint64_t t = sample_start(w);
+    bench_free(p);
+    sample_end(w, t);
+
+}
+
+static pthread_barrier_t round_barrier;
+
+/* larson: every thread replaces random slots of its array with new blocks of
+   random size. Between rounds the arrays rotate to the next thread, so most
+   blocks are freed by a different thread than the one that allocated them. */
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 20
+static void** larson_slots[MAX_THREADS];
+
+static void larson_setup(int nthreads)
+{
+
+    for (int i = 0; i < nthreads; i++)
+        larson_slots[i] = calloc(LARSON_SLOTS, sizeof(void*));
+
+}
+
+static void larson_run(worker* w)
+{
+
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        void** slots = larson_slots[(w->id + round) % w->nthreads];
+        for (long i = 0; i < 10000 * scale; i++) {
+            size_t k = rnd(w) % LARSON_SLOTS;
+            if (slots[k])
+                timed_free(w, slots[k]);
+            slots[k] = timed_alloc(w, 16 + rnd(w) % 1009);
+        }
+        pthread_barrier_wait(&round_barrier);
+    }
+    pthread_barrier_wait(&round_barrier);
+    void** slots = larson_slots[w->id];
+    for (int k = 0; k < LARSON_SLOTS; k++)
+        if (slots[k])
+            timed_free(w, slots[k]);
+
+}
+
+/* threadtest: each thread allocates a batch of small objects and frees them
+   all, over and over, never sharing anything. */
+#define THREADTEST_BATCH 1000
+
+static void threadtest_run(worker* w)
+{
+
+    void* objs[THREADTEST_BATCH];
+    for (long iter = 0; iter < 100 * scale; iter++) {
+        for (int i = 0; i < THREADTEST_BATCH; i++)
+            objs[i] = timed_alloc(w, 64);
+        for (int i = 0; i < THREADTEST_BATCH; i++)
+            timed_free(w, objs[i]);
+    }
+
+}
+
+/* xmalloc: thread i allocates and hands every block to thread i+1 through a
+   single-producer single-consumer ring, which frees it. Every free is remote. */
+#define RING_SIZE 4096
+typedef struct ring {
+    void* slots[RING_SIZE];
+    _Atomic size_t head;        // written by the consumer
+    _Atomic size_t tail;        // written by the producer
+    char pad[64];
+} ring;
+static ring* rings;
+
+static void xmalloc_setup(int nthreads)
+{
+    rings = calloc((size_t)nthreads, sizeof(ring));
+}
+
+//helper function to free whatever the producer has put in our ring
+static size_t ring_drain(worker* w, ring* r)
+{
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    for (size_t i = head; i != tail; i++)
+        timed_free(w, r->slots[i % RING_SIZE]);
+    atomic_store_explicit(&r->head, tail, memory_order_release);
+    return tail - head;
+
+}
+
+static void xmalloc_run(worker* w)
+{
+
+    ring* out = &rings[(w->id + 1) % w->nthreads];
+    ring* in = &rings[w->id];
+    long total = 200000 * scale;
+    size_t freed = 0;
+
+    for (long i = 0; i < total; i++) {
+        void* p = timed_alloc(w, 16 + rnd(w) % 241);
+        size_t tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+        while (tail - atomic_load_explicit(&out->head, memory_order_acquire) >= RING_SIZE)
+            freed += ring_drain(w, in); // keep the ring behind us moving while ours is full
+        out->slots[tail % RING_SIZE] = p;
+        atomic_store_explicit(&out->tail, tail + 1, memory_order_release);
+        if ((i & 63) == 0)
+            freed += ring_drain(w, in);
+    }
+    // every thread receives exactly as many blocks as it sends
+    while (freed < (size_t)total)
+        freed += ring_drain(w, in);
+
+}
+
+/* churn: random alloc/free over a working set, sizes mostly small with a tail
+   of large blocks, the mix a general-purpose server sees. */
+#define CHURN_SLOTS 4096
+
+//helper function to pick a churn size: 8 B..1 KiB mostly, up to 64 KiB sometimes, up to 512 KiB rarely
+static size_t churn_size(worker* w)
+{
+
+    unsigned r = rnd(w) % 100;
+    if (r < 80) return 8 + rnd(w) % 1017;
+    if (r < 99) return 1024 + rnd(w) % (64 * 1024);
+    return 64 * 1024 + rnd(w) % (448 * 1024);
+
+}
+
+static void churn_run(worker* w)
+{
+
+    void** slots = calloc(CHURN_SLOTS, sizeof(void*));
+    for (long i = 0; i < 300000 * scale; i++) {
+        size_t k = rnd(w) % CHURN_SLOTS;
+        if (slots[k]) {
+            timed_free(w, slots[k]);
+            slots[k] = NULL;
+        } else {
+            slots[k] = timed_alloc(w, churn_size(w));
+        }
+    }
+    for (int k = 0; k < CHURN_SLOTS; k++)
+        if (slots[k])
+            timed_free(w, slots[k]);
+    free(slots);
+
+}
+
+/* realloc: buffers grow by random steps from a few bytes to a few megabytes,
+   like vectors and string builders do, then are dropped. */
+#define REALLOC_BUFFERS 8
+
+static void realloc_run(worker* w)
+{
+
+    for (long iter = 0; iter < 20 * scale; iter++) {
+        char* bufs[REALLOC_BUFFERS] = { 0 };
+        size_t sizes[REALLOC_BUFFERS] = { 0 };
+        for (int step = 0; step < 400; step++) {
+            int b = (int)(rnd(w) % REALLOC_BUFFERS);
+            size_t grow = sizes[b] / 8 + 16 + rnd(w) % 256;
+            if (sizes[b] + grow > (4u << 20))
+                continue;
+            uint64_t t = sample_start(w);
+            char* p = bench_resize(bufs[b], sizes[b] + grow);
+            sample_end(w, t);
+            if (!p) {
+                fprintf(stderr, "resize to %zu bytes failed\n", sizes[b] + grow);
+                exit(1);
+            }
+            p[sizes[b] + grow - 1] = 1;
+            bufs[b] = p;
+            sizes[b] += grow;
+        }
+        for (int b = 0; b < REALLOC_BUFFERS; b++)
+            if (bufs[b])
+                timed_free(w, bufs[b]);
+    }
+
+}
+
+static const workload workloads[] = {
+    { "larson", larson_run, larson_setup },
+    { "threadtest", threadtest_run, NULL },
+    { "xmalloc", xmalloc_run, xmalloc_setup },
+    { "churn", churn_run, NULL },
+    { "realloc", realloc_run, NULL },
+};
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+typedef struct result {
+    double ops_per_sec;
+    uint32_t p50;
+    uint32_t p99;
+} result;
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static const workload* current;
+
+static void* worker_thread(void* arg)
+{
+
+    worker* w = (worker*)arg;
+    pthread_barrier_wait(&round_barrier); // start together
+    current->run(w);
+    return NULL;
+
+}
+
+//helper function to run one workload with `nthreads` threads, in the calling (child) process
+static result run_workload(const workload* wl, int nthreads)
+{
+
+    current = wl;
+    if (wl->setup)
+        wl->setup(nthreads);
+    pthread_barrier_init(&round_barrier, NULL, (unsigned)nthreads);
+
+    worker* ws = calloc((size_t)nthreads, sizeof(worker));
+    for (int i = 0; i < nthreads; i++) {
+        ws[i].id = i;
+        ws[i].nthreads = nthreads;
+        ws[i].seed = 2463534242u + (unsigned)i * 7919u;
+        ws[i].samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&ws[i].thread, NULL, worker_thread, &ws[i]);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(ws[i].thread, NULL);
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    uint64_t ops = 0;
+    size_t nsamples = 0;
+    for (int i = 0; i < nthreads; i++) {
+        ops += ws[i].ops;
+        nsamples += ws[i].nsamples;
+    }
+    uint32_t* all = malloc((nsamples + 1) * sizeof(uint32_t));
+    size_t n = 0;
+    for (int i = 0; i < nthreads; i++) {
+        memcpy(all + n, ws[i].samples, ws[i].nsamples * sizeof(uint32_t));
+        n += ws[i].nsamples;
+    }
+    qsort(all, n, sizeof(uint32_t), cmp_u32);
+
+    result r = { (double)ops / secs, n ? all[n / 2] : 0, n ? all[n * 99 / 100] : 0 };
+    return r;
+
+}
+
+static void usage(const char* prog)
+{
+
+    fprintf(stderr, "usage: %s [-t max_threads] [-s scale] [workload...]\n", prog);
+    fprintf(stderr, "workloads:");
+    for (size_t i = 0; i < NWORKLOADS; i++)
+        fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+
+}
+
+int main(int argc, char** argv)
+{
+
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:h")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 's': scale = atol(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (max_threads < 1) max_threads = 1;
+    if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+    if (scale < 1) scale = 1;
+
+    bool selected[NWORKLOADS];
+    for (size_t i = 0; i < NWORKLOADS; i++)
+        selected[i] = optind == argc;
+    for (int a = optind; a < argc; a++) {
+        size_t i = 0;
+        while (i < NWORKLOADS && strcmp(argv[a], workloads[i].name) != 0)
+            i++;
+        if (i == NWORKLOADS)
+            usage(argv[0]);
+        selected[i] = true;
+    }
+
+    printf("%-10s %-12s %7s %14s %9s %9s %12s\n",
+           "allocator", "workload", "threads", "ops/sec", "p50(ns)", "p99(ns)", "peak_rss(KB)");
+
+    for (size_t i = 0; i < NWORKLOADS; i++) {
+        if (!selected[i])
+            continue;
+        // 1, 2, 4, ... and max_threads itself
+        for (int t = 1; t <= max_threads; t = (t < max_threads && t * 2 > max_threads) ? max_threads : t * 2) {
+            int fds[2];
+            if (pipe(fds) == -1) {
+                perror("pipe");
+                return 1;
+            }
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                result r = run_workload(&workloads[i], t);
+                if (write(fds[1], &r, sizeof(r)) != (ssize_t)sizeof(r))
+                    _exit(1);
+                _exit(0);
+            }
+            close(fds[1]);
+            result r;
+            ssize_t got = read(fds[0], &r, sizeof(r));
+            close(fds[0]);
+            int status;
+            struct rusage ru;
+            wait4(pid, &status, 0, &ru);
+            if (got != (ssize_t)sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("%-10s %-12s %7d %14s\n", ALLOCATOR, workloads[i].name, t, "FAILED");
+            } else {
+                printf("%-10s %-12s %7d %14.0f %9u %9u %12ld\n", ALLOCATOR, workloads[i].name, t,
+                       r.ops_per_sec, r.p50, r.p99, ru.ru_maxrss);
+            }
+        }
+    }
+    return 0;
+
+}
@@ -0,0 +1,285 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "memory_allocator.h"
+
+/* Replays a trace recorded with memtrace_start() against this allocator and
+   reports the time it took, the peak heap and the fragmentation.
+
+       ./replay [-t threads] trace.bin
+
+   The events are sorted by time and every traced block gets a slot, so a free
+   finds the block its allocation returned in this run. With -t N, traced
+   thread i is replayed by thread i % N; -t 0 gives every traced thread its
+   own. A thread that frees a block another one allocates waits until that
+   allocation has happened, which keeps the traced order between threads.
+   The tool's own tables are mapped directly, so the heap figures are the
+   trace's alone. */
+
+#define MAX_THREADS 256
+#define NO_SLOT UINT32_MAX
+
+// one call to make, with the traced addresses already turned into slots
+typedef struct replay_op {
+    uint64_t size;
+    uint64_t alignment;
+    uint32_t op;
+    uint32_t slot;              // slot the result goes to
+    uint32_t old_slot;          // block freed or resized, NO_SLOT for none
+    uint32_t thread;
+} replay_op;
+
+typedef struct replayer {
+    pthread_t thread;
+    replay_op** ops;            // this thread's ops, in traced order
+    size_t count;
+} replayer;
+
+static _Atomic(void*)* slots;
+static char failed_marker;      // stored in the slot of an allocation that failed
+static pthread_barrier_t start_barrier;
+
+//helper function to read a monotonic clock in nanoseconds
+static inline uint64_t now_ns(void)
+{
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+
+}
+
+//helper function to get zeroed memory outside the allocator being measured
+static void* table(size_t bytes)
+{
+
+    void* p = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+
+}
+
+static const memtrace_event_t* events;
+
+//helper function to order events by time, then by where they sit in the file
+static int cmp_event(const void* a, const void* b)
+{
+
+    uint32_t i = *(const uint32_t*)a, j = *(const uint32_t*)b;
+    if (events[i].time_ns != events[j].time_ns)
+        return events[i].time_ns < events[j].time_ns ? -1 : 1;
+    return i < j ? -1 : i > j;
+
+}
+
+/* Traced address -> slot of the block living there. Open addressing; a freed
+   address keeps its entry with NO_SLOT, so a later block at the same address
+   simply takes it over. */
+typedef struct addr_entry {
+    uint64_t addr;
+    uint32_t slot;
+} addr_entry;
+
+static addr_entry* addr_map;
+static size_t addr_mask;
+
+//helper function to find the entry for `addr`, or the empty one where it goes
+static addr_entry* addr_find(uint64_t addr)
+{
+
+    size_t i = (size_t)((addr >> 4) * 0x9E3779B97F4A7C15ULL) & addr_mask;
+    while (addr_map[i].addr && addr_map[i].addr != addr)
+        i = (i + 1) & addr_mask;
+    return &addr_map[i];
+
+}
+
+//helper function to wait for the block in `slot`, allocated by whichever thread owns it
+static void* slot_wait(uint32_t slot)
+{
+
+    void* p;
+    while (!(p = atomic_load_explicit(&slots[slot], memory_order_acquire)))
+        sched_yield();
+    return p == &failed_marker ? NULL : p;
+
+}
+
+static void* replay_thread(void* arg)
+{
+
+    replayer* r = (replayer*)arg;
+    pthread_barrier_wait(&start_barrier);
+
+    for (size_t i = 0; i < r->count; i++) {
+        replay_op* op = r->ops[i];
+        void* old = op->old_slot == NO_SLOT ? NULL : slot_wait(op->old_slot);
+        void* p = NULL;
+        switch (op->op) {
+        case MEMTRACE_ALLOC: p = memalloc(op->size); break;
+        case MEMTRACE_CALLOC: p = defalloc(1, op->size); break;
+        case MEMTRACE_ALIGNED: p = memalloc_aligned(op->size, op->alignment); break;
+        case MEMTRACE_RESIZE: p = memresize(old, op->size); break;
+        case MEMTRACE_FREE: memfree(old); break;
+        }
+        if (op->slot != NO_SLOT)
+            atomic_store_explicit(&slots[op->slot], p ? p : (void*)&failed_marker, memory_order_release);
+    }
+    return NULL;
+
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] trace_file\n"
+                    "  -t N  replay on N threads, traced thread i on thread i %% N (default 1, 0 = one per traced thread)\n", prog);
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+
+    int nthreads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:h")) != -1) {
+        switch (opt) {
+        case 't': nthreads = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nthreads < 0)
+        usage(argv[0]);
+
+    // map the trace and check its header
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size_t header = 2 * sizeof(uint32_t);
+    const uint32_t* file = st.st_size >= (off_t)header ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (file == MAP_FAILED || file[0] != MEMTRACE_MAGIC || file[1] != MEMTRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d trace\n", argv[optind], MEMTRACE_VERSION);
+        return 1;
+    }
+    events = (const memtrace_event_t*)(file + 2);
+    size_t nevents = (st.st_size - header) / sizeof(memtrace_event_t);
+
+    uint32_t* order = table(nevents * sizeof(uint32_t));
+    for (size_t i = 0; i < nevents; i++)
+        order[i] = (uint32_t)i;
+    qsort(order, nevents, sizeof(uint32_t), cmp_event);
+
+    // turn addresses into slots, and work out how many bytes the trace itself had live at most
+    size_t map_size = 16;
+    while (map_size < 2 * nevents)
+        map_size <<= 1;
+    addr_map = table(map_size * sizeof(addr_entry));
+    addr_mask = map_size - 1;
+    replay_op* ops = table(nevents * sizeof(replay_op));
+    uint64_t* slot_size = table(nevents * sizeof(uint64_t));
+    size_t nops = 0, nslots = 0, unmatched = 0, counts[MEMTRACE_FREE + 1] = { 0 };
+    uint64_t live = 0, peak_live = 0;
+    uint32_t max_thread = 0;
+
+    for (size_t k = 0; k < nevents; k++) {
+        const memtrace_event_t* ev = &events[order[k]];
+        if (ev->op < MEMTRACE_ALLOC || ev->op > MEMTRACE_FREE)
+            continue;
+        replay_op* op = &ops[nops];
+        op->op = ev->op;
+        op->size = ev->size;
+        op->alignment = ev->op == MEMTRACE_ALIGNED ? ev->old_object : 0;
+        op->thread = ev->thread;
+        op->slot = op->old_slot = NO_SLOT;
+
+        // the block being freed or resized, if it was allocated while recording
+        uint64_t old_addr = ev->op == MEMTRACE_FREE ? ev->object : ev->op == MEMTRACE_RESIZE ? ev->old_object : 0;
+        if (old_addr) {
+            addr_entry* e = addr_find(old_addr);
+            if (e->addr && e->slot != NO_SLOT) {
+                op->old_slot = e->slot;
+                live -= slot_size[e->slot];
+                e->slot = NO_SLOT;
+            } else {
+                unmatched++;
+                if (ev->op == MEMTRACE_FREE)
+                    continue; // a block from before the recording, nothing to free
+            }
+        }
+
+        if (ev->op != MEMTRACE_FREE && ev->object) {
+            addr_entry* e = addr_find(ev->object);
+            e->addr = ev->object;
+            e->slot = op->slot = (uint32_t)nslots;
+            slot_size[nslots++] = ev->size;
+            live += ev->size;
+            if (live > peak_live)
+                peak_live = live;
+        }
+        if (ev->thread > max_thread)
+            max_thread = ev->thread;
+        counts[ev->op]++;
+        nops++;
+    }
+    slots = table(nslots * sizeof(void*));
+
+    // hand every op to the thread that replays its traced thread, keeping their order
+    if (nthreads == 0)
+        nthreads = max_thread ? (int)max_thread : 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    static replayer replayers[MAX_THREADS];
+    replay_op** lists = table(nops * sizeof(replay_op*));
+    for (size_t i = 0; i < nops; i++)
+        replayers[ops[i].thread % nthreads].count++;
+    size_t pos = 0;
+    for (int t = 0; t < nthreads; t++) {
+        replayers[t].ops = lists + pos;
+        pos += replayers[t].count;
+        replayers[t].count = 0;
+    }
+    for (size_t i = 0; i < nops; i++) {
+        replayer* r = &replayers[ops[i].thread % nthreads];
+        r->ops[r->count++] = &ops[i];
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1);
+    for (int t = 0; t < nthreads; t++)
+        pthread_create(&replayers[t].thread, NULL, replay_thread, &replayers[t]);
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(replayers[t].thread, NULL);
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    memstats_t ms;
+    memstats(&ms);
+    printf("%-22s %zu (alloc %zu, calloc %zu, aligned %zu, resize %zu, free %zu, unmatched %zu)\n",
+           "events", nops, counts[MEMTRACE_ALLOC], counts[MEMTRACE_CALLOC], counts[MEMTRACE_ALIGNED],
+           counts[MEMTRACE_RESIZE], counts[MEMTRACE_FREE], unmatched);
+    printf("%-22s %u traced, %d replaying\n", "threads", max_thread, nthreads);
+    printf("%-22s %.3f s, %.0f ops/sec\n", "time", seconds, seconds > 0 ? (double)nops / seconds : 0.0);
+    printf("%-22s %llu\n", "peak_live_bytes", (unsigned long long)peak_live);
+    printf("%-22s %zu\n", "peak_heap_bytes", ms.heap_peak);
+    printf("%-22s %.3f\n", "peak_heap/peak_live", peak_live ? (double)ms.heap_peak / (double)peak_live : 0.0);
+    printf("%-22s %zu\n", "end_heap_bytes", ms.heap_size);
+    printf("%-22s %zu\n", "end_bytes_in_use", ms.bytes_in_use);
+    printf("%-22s %.4f\n", "end_fragmentation", ms.fragmentation);
+    return 0;
+
+}
@@ -0,0 +1,225 @@
+/* Drop-in replacements for the C library allocation functions, built into
+   libmemalloc.so so an unmodified program can run on this allocator:
+
+       LD_PRELOAD=./libmemalloc.so ./program
+
+   Everything is forwarded to memalloc/memfree/memresize/defalloc. The one
+   thing the allocator cannot handle itself is being called again from inside
+   itself: the first allocation sets up arenas and thread keys, and the C
+   library may allocate while doing that. Such nested calls are served from a
+   static bootstrap buffer that is never freed. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "memory_allocator.h"
+
+#define ALIGNMENT 16
+#define ROUND_UP(x,a) (((x) + ((a) - 1)) & ~((a) - 1))
+#define OS_PAGE_SIZE 0x1000
+#define BOOTSTRAP_SIZE 0x10000                      // room for allocations made while the allocator is busy
+#define BOOTSTRAP_HEADER ALIGNMENT                  // each bootstrap block keeps its size in front of it
+
+static _Alignas(ALIGNMENT) char bootstrap[BOOTSTRAP_SIZE];
+static atomic_size_t bootstrap_used;
+static __thread int shim_depth;                     // > 0 while this thread is inside the allocator
+
+//helper function to carve `size` bytes from the bootstrap buffer, NULL once it is full
+static void* bootstrap_alloc(size_t size, size_t alignment)
+{
+
+    if (alignment < ALIGNMENT)
+        alignment = ALIGNMENT;
+    if (size > BOOTSTRAP_SIZE || alignment > BOOTSTRAP_SIZE)
+        return NULL;
+
+    size_t need = ROUND_UP(BOOTSTRAP_HEADER + size, ALIGNMENT) + alignment - ALIGNMENT;
+    size_t start = atomic_fetch_add(&bootstrap_used, need);
+    if (start + need > BOOTSTRAP_SIZE)
+        return NULL;
+
+    // the buffer is never reused, so its memory is still zero
+    uintptr_t payload = ROUND_UP((uintptr_t)bootstrap + start + BOOTSTRAP_HEADER, alignment);
+    *(size_t*)(payload - BOOTSTRAP_HEADER) = size;
+    return (void*)payload;
+
+}
+
+//helper function to tell whether `ptr` came from the bootstrap buffer
+static int in_bootstrap(const void* ptr)
+{
+    return (const char*)ptr >= bootstrap && (const char*)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+//helper function to read the size a bootstrap block was allocated with
+static size_t bootstrap_size(const void* ptr)
+{
+    return *(const size_t*)((const char*)ptr - BOOTSTRAP_HEADER);
+}
+
+//helper function for all the aligned variants, returns 0 or an errno value
+static int aligned_alloc_common(void** out, size_t alignment, size_t size)
+{
+
+    if (alignment == 0 || (alignment & (alignment - 1)))
+        return EINVAL;
+    if (size == 0)
+        size = 1;
+
+    void* p = NULL;
+    if (shim_depth)
+        p = bootstrap_alloc(size, alignment);
+    if (!p) {
+        shim_depth++;
+        p = memalloc_aligned(size, alignment);
+        shim_depth--;
+    }
+    if (!p)
+        return ENOMEM;
+    *out = p;
+    return 0;
+
+}
+
+void* malloc(size_t size)
+{
+
+    // malloc(0) returns a unique pointer, as glibc's does
+    if (size == 0)
+        size = 1;
+
+    if (shim_depth) {
+        void* p = bootstrap_alloc(size, ALIGNMENT);
+        if (p)
+            return p;
+    }
+    shim_depth++;
+    void* p = memalloc(size);
+    shim_depth--;
+    if (!p)
+        errno = ENOMEM;
+    return p;
+
+}
+
+void free(void* ptr)
+{
+
+    if (!ptr || in_bootstrap(ptr))
+        return;
+    shim_depth++;
+    memfree(ptr);
+    shim_depth--;
+
+}
+
+void* calloc(size_t num_elements, size_t element_size)
+{
+
+    if (element_size && num_elements > SIZE_MAX / element_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (num_elements == 0 || element_size == 0)
+        num_elements = element_size = 1;
+
+    if (shim_depth) {
+        void* p = bootstrap_alloc(num_elements * element_size, ALIGNMENT);
+        if (p)
+            return p;
+    }
+    shim_depth++;
+    void* p = defalloc(num_elements, element_size);
+    shim_depth--;
+    if (!p)
+        errno = ENOMEM;
+    return p;
+
+}
+
+void* realloc(void* ptr, size_t size)
+{
+
+    if (!ptr)
+        return malloc(size);
+
+    // bootstrap blocks cannot grow, they are copied out to an ordinary block
+    if (in_bootstrap(ptr)) {
+        if (size == 0)
+            return NULL;
+        void* p = malloc(size);
+        if (p) {
+            size_t old = bootstrap_size(ptr);
+            memcpy(p, ptr, old < size ? old : size);
+        }
+        return p;
+    }
+
+    shim_depth++;
+    void* p = memresize(ptr, size); // size 0 frees and returns NULL, as glibc does
+    shim_depth--;
+    if (!p && size)
+        errno = ENOMEM;
+    return p;
+
+}
+
+void* reallocarray(void* ptr, size_t num_elements, size_t element_size)
+{
+
+    if (element_size && num_elements > SIZE_MAX / element_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, num_elements * element_size);
+
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+
+    if (alignment % sizeof(void*))
+        return EINVAL;
+    return aligned_alloc_common(memptr, alignment, size);
+
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+
+    void* p = NULL;
+    int err = aligned_alloc_common(&p, alignment, size);
+    if (err)
+        errno = err;
+    return p;
+
+}
+
+// obsolete, but still called by older code and must not reach glibc's allocator
+void* memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+void* valloc(size_t size)
+{
+    return aligned_alloc(OS_PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size)
+{
+    return aligned_alloc(OS_PAGE_SIZE, ROUND_UP(size, OS_PAGE_SIZE));
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+
+    if (!ptr)
+        return 0;
+    if (in_bootstrap(ptr))
+        return bootstrap_size(ptr);
+    return memusable_size(ptr);
+
+}
@@ -1,101 +1,637 @@
+#define _GNU_SOURCE   // mremap
 #include <stdbool.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <signal.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#include "memory_allocator.h"
 
 #define TRUE 1
 #define FALSE 0
 
-static void* free_list = NULL;
-static void* heap_start = NULL;
-static void* heap_end = NULL;
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
-#define PAGE_SIZE 0x4000
-#define MMAP_THRESHOLD 0x20000
+#define PAGE_SIZE 0x4000                            // smallest heap growth step, unless memallopt changes it
+#define GROW_SIZE_MAX 0x4000000                     // largest growth step memallopt accepts (64 MiB)
+#define MAX_GROW_GRANULE 0x100000                   // growth step cap, reached once the heap is 8 MiB
+#define TRIM_THRESHOLD 0x100000                     // top chunk size that triggers giving memory back
+#define TOP_PAD 0x20000                             // bytes of top chunk kept when trimming
+#define MMAP_THRESHOLD 0x20000                      // initial size from which requests are mmap'ed
+#define STREAM_THRESHOLD 0x100000                   // fills and copies this big bypass the cache
+#define MMAP_THRESHOLD_MAX 0x400000                 // the dynamic threshold never rises past 4 MiB
+#define MMAP_THRESHOLD_LIMIT 0x2000000              // largest threshold memallopt accepts (32 MiB)
+#define OS_PAGE_SIZE 0x1000                         // mappings and purges are whole OS pages
+
+#define PURGE_MIN 0x10000                           // smaller free blocks are never purged
+#define PURGE_DECAY_MS 5000                         // free blocks unused this long are purged
+#define PURGE_DECAY_MAX_MS 86400000                 // longest decay memallopt accepts (a day)
+#define PURGE_INTERVAL_MS 1000                      // an arena looks for purgeable blocks at most this often
+#define PURGE_CHECK_EVERY 256                       // heap frees between clock reads
+
+#define MMAP_CACHE_SLOTS 16                         // unmapped chunks kept for reuse
+#define MMAP_CACHE_MAX_BYTES 0x4000000              // bytes the cache may hold in total (64 MiB)
+#define MMAP_CACHE_BYTES_LIMIT 0x40000000           // largest cache size memallopt accepts (1 GiB)
+#define MMAP_CACHE_MAX_CHUNK 0x1000000              // larger chunks are always unmapped (16 MiB)
+#define MMAP_CACHE_AGE_MS 1000                      // chunks cached longer than this are unmapped
+#define MMAP_CACHE_SLACK 4                          // a reused chunk may exceed the request by 1/4
 #define ALIGNMENT 16
 #define ROUND_UP(x,a) (((x) + ((a) - 1)) & ~((a) - 1))
 
+#define TCACHE_MAX_SIZE 1024                        // largest request served from a thread cache
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT)   // one bin per 16-byte size class
+#define TCACHE_COUNT 32                             // blocks kept per bin before flushing
+#define TCACHE_COUNT_MAX 4096                       // largest count memallopt accepts
+#define REMOTE_FREE_MAX 256                         // remote frees queued before the freeing thread drains them itself
+#define SIZE_CLASS(n) (((n) - 1) / ALIGNMENT)       // request size -> tcache bin
+
+#define SMALL_BINS 64                               // exact-size bins, one per 16-byte payload step
+#define SMALL_BIN_LIMIT (SMALL_BINS * ALIGNMENT)    // payloads below this land in an exact bin
+#define LARGE_BIN_SHIFT 2                           // 4 log-spaced bins per power of two above it
+#define NBINS 128
+#define BITMAP_WORDS (NBINS / 64)
+
+#define SLAB_SIZE 0x10000                           // slabs are 64 KiB and aligned to their size
+#define SLAB_REGION_SIZE ((size_t)1 << 30)          // address space reserved for all slabs
+#define SLAB_MAX_SIZE 128                           // largest request served from a slab
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_OF(p) ((slab*)((uintptr_t)(p) & ~((uintptr_t)SLAB_SIZE - 1)))
+
+#define PROF_DEFAULT_INTERVAL 0x80000               // mean bytes between heap profile samples (512 KiB)
+#define PROF_MAX_DEPTH 32                           // frames recorded per sample
+#define PROF_SKIP_FRAMES 2                          // the profiler's own frame and the allocation call
+#define PROF_STACK_BUCKETS 4096                     // hash buckets for distinct call stacks
+#define PROF_LIVE_BUCKETS 16384                     // hash buckets for live sampled blocks
+#define PROF_CHUNK_SIZE 0x100000                    // profiler bookkeeping is mapped in 1 MiB chunks
+#define PROF_PATH_MAX 256
+#define TRACE_BUFFER_EVENTS 1024                    // events a thread collects before writing them out
+
+#define MAX_ARENAS 16
+#define ARENA_RESERVE ((size_t)1 << 36)             // address space reserved for each arena's heap (64 GiB)
+#define ARENA_MIN_RESERVE ((size_t)1 << 28)         // smallest reservation tried when address space is short
+
+// where a freed block is placed inside its bin
+#define PLACEMENT_LIFO MEMALLOPT_FIT_LIFO         // head: most recently freed block is reused first (locality)
+#define PLACEMENT_FIFO MEMALLOPT_FIT_FIFO         // tail: oldest free block is reused first
+#define PLACEMENT_ADDRESS MEMALLOPT_FIT_ADDRESS   // sorted by address: lowest block first (less fragmentation)
+
+#ifndef MEMALLOC_PLACEMENT
+#define MEMALLOC_PLACEMENT PLACEMENT_FIFO
+#endif
+
+/* A heap block is one size word followed by its payload. The payload is
+   16-byte aligned, so blocks start 8 bytes before a 16-byte boundary and
+   payload sizes are 8 more than a multiple of 16, which leaves the low bits of
+   the size word for flags. Only a free block uses its payload for bookkeeping:
+   bin links and purge state at the front, and a footer holding its size in
+   the last 8 bytes, found through the next block's BLOCK_PREV_FREE flag.
+   The 8 bytes at the end of the heap are a zero "fence" that reads as an
+   allocated block of size 0, so no walk or merge runs off the end. */
 typedef struct block_header {
-    uint8_t is_free;
-    size_t size;          // payload size
-    void* prev_block;
-    void* next_block;
+    size_t size;          // payload size | BLOCK_FREE | BLOCK_PREV_FREE
+    // the fields below exist only while the block is free
+    struct block_header* prev_block;
+    struct block_header* next_block;
+    uint32_t freed_at;    // ms timestamp, only kept for free blocks of at least PURGE_MIN
+    uint8_t is_purged;    // free block whose interior pages were handed back with madvise
 } block_header;
-_Static_assert(sizeof(block_header) % ALIGNMENT == 0, "header not aligned!");
-#define BLOCK_HEADER_SIZE sizeof(block_header)
+#define BLOCK_HEADER_SIZE sizeof(size_t)            // all an allocated block carries
 
 typedef struct block_footer {
-    size_t size;          // payload size
+    size_t size;          // payload size, last 8 bytes of a free block's payload
 } block_footer;
-//_Static_assert(sizeof(block_footer) % ALIGNMENT == 0, "footer not aligned!"); Probably won't compile since size is only 8 bytes
 #define BLOCK_FOOTER_SIZE sizeof(block_footer)
 
-#define MIN_SPLIT (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE + ALIGNMENT)
+#define BLOCK_FREE 0x1                              // the block is free
+#define BLOCK_PREV_FREE 0x2                         // the block before it is free and has a footer
+#define BLOCK_FLAGS (BLOCK_FREE | BLOCK_PREV_FREE)
+#define BLOCK_SIZE(h) ((h)->size & ~(size_t)BLOCK_FLAGS)
+#define NEXT_BLOCK(h) ((block_header*)((char*)(h) + BLOCK_HEADER_SIZE + BLOCK_SIZE(h)))
+
+// smallest block: room for the free-block fields and a footer
+#define MIN_BLOCK ROUND_UP(sizeof(block_header) + BLOCK_FOOTER_SIZE, ALIGNMENT)
+#define MIN_LEAD MIN_BLOCK                          // smallest leading gap that can become a free block
+// payload handed out for a request of n bytes
+#define BLOCK_PAYLOAD(n) ((ROUND_UP(BLOCK_HEADER_SIZE + (n), ALIGNMENT) < MIN_BLOCK ? MIN_BLOCK : \
+                          ROUND_UP(BLOCK_HEADER_SIZE + (n), ALIGNMENT)) - BLOCK_HEADER_SIZE)
+#define MAX_ALIGNMENT ((size_t)1 << 30)            // larger alignments trim their mapping so header offsets fit 32 bits
 
 typedef struct mmap_block_header {
-    size_t size;
+    size_t size;          // payload size, up to the end of the mapping
     uint8_t is_mmap;
+    uint32_t offset;      // bytes between the start of the mapping and this header
 } mmap_block_header;
 _Static_assert(sizeof(mmap_block_header) % ALIGNMENT == 0, "mmap header not aligned!");
 #define MMAP_HEADER_SIZE sizeof(mmap_block_header)
 
+
+/* Freed mmap'ed chunks are parked in a small cache instead of being unmapped,
+   so a buffer size that keeps coming back skips the mmap/munmap pair and its
+   page faults. A chunk is reused for a request of about its size and is
+   unmapped once it has gone unused for MMAP_CACHE_AGE_MS.
+
+   As in glibc, freeing an mmap'ed chunk above the current threshold raises
+   the threshold to that chunk's size (up to MMAP_THRESHOLD_MAX), so sizes
+   that are allocated over and over move to the heap. The heap trim threshold
+   follows at twice the mmap threshold. */
+typedef struct mmap_cache_entry {
+    void* base;
+    size_t len;           // mapping length, a multiple of OS_PAGE_SIZE
+    uint64_t stamp;       // when it was cached, in ms
+} mmap_cache_entry;
+
+static mmap_cache_entry mmap_cache[MMAP_CACHE_SLOTS];
+static size_t mmap_cached_bytes = 0;
+static pthread_mutex_t mmap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t mmap_threshold = MMAP_THRESHOLD;
+static atomic_size_t trim_threshold = TRIM_THRESHOLD;
+
+/* Settings memallopt() and MEMALLOC_CONF can change while the program runs.
+   Each is read where it is used, so a change applies from the next call that
+   looks at it. MEMALLOC_CONF is applied once, before the first allocation
+   that is not served from a thread cache. */
+static atomic_size_t grow_size = PAGE_SIZE;
+static atomic_bool mmap_threshold_fixed;            // set through memallopt, the threshold stops adapting
+static atomic_uint tcache_count = TCACHE_COUNT;
+static size_t mmap_cache_max = MMAP_CACHE_MAX_BYTES;    // guarded by mmap_cache_lock
+static atomic_uint purge_decay_ms = PURGE_DECAY_MS;
+static atomic_int placement_policy = MEMALLOC_PLACEMENT;
+static atomic_bool stats_enabled = TRUE;
+static atomic_bool conf_loaded;
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+
+/* Small requests are served from slabs: SLAB_SIZE pages carved from one
+   reserved region, each holding objects of a single size class with no
+   per-object header. The slab header sits at the start of the page, so
+   memfree recognises a slab object by its address range and finds the
+   header by masking the pointer. Freed objects form a freelist threaded
+   through the objects themselves. */
+typedef struct slab {
+    struct slab* prev;    // neighbours in the partial list of its class
+    struct slab* next;
+    struct arena* owner;  // arena whose lock protects this slab
+    void* free_objs;      // objects handed back by memfree
+    char* bump;           // first object never handed out
+    uint32_t obj_size;
+    uint32_t size_class;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t bump_zero;   // objects past bump are still zero, the slab came fresh from the region
+} slab;
+#define SLAB_HEADER_SIZE ROUND_UP(sizeof(slab), ALIGNMENT)
+
+static char* slab_region_start = NULL;
+static char* slab_region_end = NULL;
+static char* slab_region_next = NULL;
+static slab* slab_empty = NULL;            // fully free slabs, reusable by any arena and class
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;  // guards the region and slab_empty
+
+/* The heap is split into arenas, each an independently locked heap in its own
+   mmap-reserved address range. The range is committed from the bottom up as
+   the heap grows, so heap_end plays the part of a private program break and
+   nothing else in the process can move it. Threads are spread over the
+   arenas round-robin; a block always goes back to the arena whose range
+   contains it.
+
+   The free block that ends at heap_end is the "top" (wilderness) chunk. It
+   is kept out of the bins and has no footer, since nothing lies to its right.
+   Requests no bin can satisfy are carved from it, and it absorbs both newly
+   committed memory and blocks freed next to it.
+
+   Large free blocks that stay unused for purge_decay_ms are purged: the
+   whole pages between their header and footer are released with
+   MADV_DONTNEED, so they stop counting towards RSS but keep their place in
+   the heap. Arenas look for such blocks every PURGE_INTERVAL_MS while frees
+   keep coming, and memtrim() purges everything at once.
+
+   Free blocks are kept in segregated bins instead of one list. Small payloads
+   get an exact bin each, larger ones share log-spaced bins. A bit per bin in
+   bin_bitmap says whether it holds anything, so finding a fit is a bit scan.
+
+   A block freed by a thread that allocates from a different arena does not
+   wait for the owner's lock. It is pushed onto the owner's remote_free stack
+   with a compare-and-swap, and whoever takes the lock next releases the whole
+   stack at once. Pushers only ever add to the stack and the lock holder
+   takes all of it with one exchange, so there is no ABA problem. */
+typedef struct arena {
+    pthread_mutex_t lock;
+    char* heap_start;                       // first byte of the reserved range
+    char* heap_end;                         // end of the committed part
+    char* heap_limit;                       // end of the reserved range
+    block_header* top;                      // free block ending at heap_end, NULL if none
+    char* clean_from;                       // nothing from here to heap_end was written since the kernel zeroed it
+    block_header* free_bins[NBINS];
+    block_header* bin_tails[NBINS];
+    uint64_t bin_bitmap[BITMAP_WORDS];
+    slab* slab_partial[SLAB_CLASSES];       // slabs with at least one free object
+    uint32_t last_purge;                    // ms timestamp of the last purge scan
+    uint32_t purge_tick;                    // heap frees since the clock was last read
+    uint64_t lock_acquired;                 // counted while holding the lock, so plain adds
+    uint64_t lock_contended;                // acquisitions that found the lock taken
+    _Alignas(64) _Atomic(struct tcache_entry*) remote_free; // blocks freed by other arenas' threads, off its own cache line
+    atomic_size_t remote_count;             // roughly how many blocks remote_free holds
+} arena;
+
+// part of a freshly allocated payload known to be zero already, empty when from == to
+typedef struct zero_span {
+    char* from;
+    char* to;
+} zero_span;
+
+static arena arenas[MAX_ARENAS];
+static atomic_size_t arena_count;           // arenas[0 .. arena_count) are initialised
+static size_t arena_limit;                  // how many arenas threads are spread over
+static atomic_uint next_arena;              // round-robin cursor
+static pthread_mutex_t arena_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static __thread arena* thread_arena;
+
+/* Freed small blocks are parked in a per-thread cache instead of going back
+   to the free list or their slab. The blocks stay marked as allocated, so the
+   shared heap never sees them until the cache overflows or the thread exits.
+   The link lives in the first bytes of the payload. */
+typedef struct tcache_entry {
+    struct tcache_entry* next;
+} tcache_entry;
+
+typedef struct tcache {
+    tcache_entry* entries[TCACHE_BINS];
+    uint16_t counts[TCACHE_BINS];
+    bool registered;      // exit destructor installed for this thread
+    bool disabled;        // thread is exiting, bypass the cache
+} tcache;
+
+static __thread tcache thread_cache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Allocation counters live in a per-thread block, so counting is a plain add
+   on a cache line no other thread writes. Each block is linked into
+   stats_threads the first time its thread counts something; memstats() sums
+   the list, and an exiting thread folds its counts into stats_retired. The
+   counters are atomics only so the reader may load them while the owner
+   updates them, the owner never needs a locked instruction. */
+#define STATS_CLASSES MEMSTATS_CLASSES
+#define STATS_NEW 0
+#define STATS_ACTIVE 1
+#define STATS_RETIRED 2
+#define STAT_ADD(c, n) atomic_store_explicit(&(c), atomic_load_explicit(&(c), memory_order_relaxed) + (n), memory_order_relaxed)
+
+typedef struct thread_stats {
+    _Atomic uint64_t alloc_count[STATS_CLASSES];
+    _Atomic uint64_t free_count[STATS_CLASSES];
+    _Atomic uint64_t bytes_requested;
+    struct thread_stats* prev;
+    struct thread_stats* next;
+    int state;
+} thread_stats;
+
+static __thread thread_stats thread_counters;
+static thread_stats* stats_threads = NULL;
+static thread_stats stats_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/* The heap profiler samples about one allocation per prof_interval bytes.
+   Each thread counts down the bytes it allocates, and when the count runs
+   out the allocation is sampled and a new count is drawn from an exponential
+   distribution, so every byte is equally likely to be sampled whatever the
+   allocation sizes. A sampled allocation records its call stack. Samples
+   with the same stack share one prof_stack, which keeps live and total
+   counts, and each live sample sits in a hash table keyed by its address
+   until it is freed. The tables live in their own mappings, so the profiler
+   never calls back into the allocator. With profiling off, allocation and
+   free paths only load prof_interval. */
+typedef struct prof_stack {
+    struct prof_stack* next;        // next stack in the same bucket
+    uint64_t hash;
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+    int depth;
+    void* frames[PROF_MAX_DEPTH];
+} prof_stack;
+
+typedef struct prof_sample {
+    struct prof_sample* next;       // next sample in the same bucket, or on the free list
+    void* ptr;
+    size_t size;
+    prof_stack* stack;
+} prof_sample;
+
+static atomic_size_t prof_interval;                         // mean bytes between samples
+static prof_stack* prof_stacks[PROF_STACK_BUCKETS];
+static _Atomic(prof_sample*) prof_live[PROF_LIVE_BUCKETS];  // atomic so frees can skip empty buckets unlocked
+static prof_sample* prof_free_samples = NULL;
+static char* prof_chunks = NULL;                            // mappings backing the tables, linked through their first word
+static char* prof_bump = NULL;
+static char* prof_bump_end = NULL;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int prof_dump_pending;                        // set by the signal handler
+static char prof_signal_path[PROF_PATH_MAX];
+static __thread int64_t prof_countdown;                     // bytes this thread allocates before its next sample
+static __thread uint64_t prof_rng;
+
+/* memtrace_start() records every allocation call to a file for bench/replay.
+   Each thread appends events to a buffer of its own and writes it out with a
+   single write() when it fills, so recording takes no lock. The in_use flag
+   only keeps memtrace_stop() from flushing a buffer while its owner appends. */
+typedef struct trace_buffer {
+    atomic_int in_use;              // held by the owner while appending, by memtrace_stop while flushing
+    uint32_t thread;                // small id, in the order threads first record something
+    size_t count;
+    struct trace_buffer* prev;      // neighbours in trace_buffers
+    struct trace_buffer* next;
+    memtrace_event_t events[TRACE_BUFFER_EVENTS];
+} trace_buffer;
+
+static trace_buffer* trace_buffers = NULL;  // every thread's buffer, guarded by trace_lock
+static int trace_fd = -1;                   // open while recording
+static uint32_t trace_threads = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread trace_buffer* thread_trace;
+
+// the profiler and the trace watch the public entry points; with both off those only load alloc_hooks
+#define HOOK_PROF 0x1
+#define HOOK_TRACE 0x2
+#define HOOKS_ACTIVE() (atomic_load_explicit(&alloc_hooks, memory_order_relaxed) != 0)
+#define PROF_ACTIVE() (atomic_load_explicit(&alloc_hooks, memory_order_relaxed) & HOOK_PROF)
+#define TRACE_ACTIVE() (atomic_load_explicit(&alloc_hooks, memory_order_relaxed) & HOOK_TRACE)
+
+static atomic_uint alloc_hooks;
+static __thread int hook_busy;                              // set while a hook runs, or around internal calls
+
+static atomic_size_t mmap_live_count;       // mappings handed out and not yet freed
+static atomic_size_t mmap_live_bytes;
+static atomic_size_t heap_committed;        // heap_end - heap_start summed over all arenas
+static atomic_size_t heap_peak;             // highest heap_committed so far
+
 void* memalloc(size_t requested_size);
 void* defalloc(size_t num_elements, size_t element_size);
 void memfree(void* ptr);
 void* memresize(void* ptr, size_t new_size);
+void* memalloc_aligned(size_t requested_size, size_t alignment);
+size_t memalloc_batch(size_t requested_size, size_t count, void** out_ptrs);
+void memfree_batch(void** ptrs, size_t count);
+void memfree_sized(void* ptr, size_t size);
+size_t memusable_size(void* ptr);
+size_t memtrim(void);
+void memstats(memstats_t* out);
+size_t memstats_dump(char* buf, size_t len, int json);
 void* memoryset(void* ptr, int c, size_t n);
 void* memdup(const void* ptr, size_t size);
-static void unlink_from_free_list(block_header* b);
-static void insert_at_tail_free_list(block_header* h);
+static void unlink_from_free_list(arena* a, block_header* b);
+static void insert_into_free_list(arena* a, block_header* h);
+static void split_block(arena* a, block_header* h, size_t payload);
+static void* heap_alloc(arena* a, size_t requested_size, zero_span* zs);
+static void heap_free(arena* a, block_header* hdr);
+static void release_block(arena* a, void* ptr);
+static void free_block(void* ptr);
+static void stats_alloc(size_t requested, size_t usable);
+static void stats_free(size_t usable);
+static uint64_t trace_now(void);
+static uint64_t now_ms(void);
+static void conf_init(void);
+
+
+
+//helper function to release the blocks other threads left on a's remote stack, caller holds a->lock
+static void remote_drain(arena* a)
+{
+
+    if (!atomic_load_explicit(&a->remote_free, memory_order_relaxed))
+        return;
+    atomic_store_explicit(&a->remote_count, 0, memory_order_relaxed);
+    tcache_entry* e = atomic_exchange_explicit(&a->remote_free, NULL, memory_order_acquire);
+    while (e) {
+        tcache_entry* next = e->next;
+        release_block(a, e);
+        e = next;
+    }
+
+}
+
+//helper function to lock an arena, counting whether it had to wait
+static void arena_lock(arena* a)
+{
+
+    if (pthread_mutex_trylock(&a->lock) != 0) {
+        pthread_mutex_lock(&a->lock);
+        a->lock_contended++;
+    }
+    a->lock_acquired++;
+    remote_drain(a);
+
+}
+
+//helper function to hand the chain `first`..`last` of `count` blocks owned by `a` to its next lock holder
+static void remote_free(arena* a, void* first, void* last, size_t count)
+{
+
+    tcache_entry* head = atomic_load_explicit(&a->remote_free, memory_order_relaxed);
+    do {
+        ((tcache_entry*)last)->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&a->remote_free, &head, (tcache_entry*)first,
+                                                    memory_order_release, memory_order_relaxed));
+
+    // an arena nobody allocates from would keep them forever, so a long stack is drained here
+    if (atomic_fetch_add_explicit(&a->remote_count, count, memory_order_relaxed) + count >= REMOTE_FREE_MAX) {
+        arena_lock(a);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+}
+
+//helper function to map a payload size to its bin
+static size_t bin_index(size_t payload)
+{
+
+    if (payload < SMALL_BIN_LIMIT)
+        return payload / ALIGNMENT;
+
+    size_t msb = 63 - (size_t)__builtin_clzll(payload);
+    size_t sub = (payload >> (msb - LARGE_BIN_SHIFT)) & ((1u << LARGE_BIN_SHIFT) - 1);
+    size_t idx = SMALL_BINS + ((msb - 10) << LARGE_BIN_SHIFT) + sub; // 2^10 == SMALL_BIN_LIMIT
+    return idx < NBINS ? idx : NBINS - 1;
+
+}
+
+//helper function to find the first non-empty bin at or after `from`
+static size_t next_nonempty_bin(arena* a, size_t from)
+{
+
+    for (size_t w = from / 64; w < BITMAP_WORDS; w++) {
+        uint64_t bits = a->bin_bitmap[w];
+        if (w == from / 64)
+            bits &= ~0ULL << (from % 64);
+        if (bits)
+            return w * 64 + (size_t)__builtin_ctzll(bits);
+    }
+    return NBINS;
+
+}
+
+//helper function to find a free block with at least `payload` bytes
+static block_header* find_free_block(arena* a, size_t payload)
+{
+
+    size_t idx = bin_index(payload);
 
+    // a large bin spans a range of sizes, so only its own entries need a fit check
+    if (idx >= SMALL_BINS) {
+        for (block_header* b = a->free_bins[idx]; b; b = b->next_block) {
+            if (BLOCK_SIZE(b) >= payload)
+                return b;
+        }
+        idx++;
+    }
 
+    // every block in a later bin is big enough
+    idx = next_nonempty_bin(a, idx);
+    return idx < NBINS ? a->free_bins[idx] : NULL;
+
+}
 
-//helper function to detach from free list
-static void unlink_from_free_list(block_header* b) 
+//helper function to detach from its free bin
+static void unlink_from_free_list(arena* a, block_header* b) 
 {
 
     if (!b) return;
+    size_t idx = bin_index(BLOCK_SIZE(b));
     if (b->prev_block) {
         ((block_header*)b->prev_block)->next_block = b->next_block;
     } else {
-        free_list = b->next_block;
+        a->free_bins[idx] = b->next_block;
+        if (!a->free_bins[idx])
+            a->bin_bitmap[idx / 64] &= ~(1ULL << (idx % 64));
     }
     if (b->next_block) {
         ((block_header*)b->next_block)->prev_block = b->prev_block;
+    } else {
+        a->bin_tails[idx] = b->prev_block;
     }
     b->prev_block = NULL;
     b->next_block = NULL;
 
 }
 
-//helper function to put free block at end of free list
-static void insert_at_tail_free_list(block_header* h) 
+//helper function to put free block into its bin according to placement_policy
+static void insert_into_free_list(arena* a, block_header* h) 
 {
 
-    if (!free_list) {
+    size_t idx = bin_index(BLOCK_SIZE(h));
+    block_header* head = a->free_bins[idx];
+    block_header* tail = a->bin_tails[idx];
+
+    if (!head) {
         h->prev_block = NULL;
         h->next_block = NULL;
-        free_list = (void*)h;
+        a->free_bins[idx] = a->bin_tails[idx] = h;
+        a->bin_bitmap[idx / 64] |= 1ULL << (idx % 64);
         return;
     }
-    block_header* curr = (block_header*)free_list;
-    while (curr->next_block) {
-        curr = (block_header*)curr->next_block;
+
+    block_header* after = tail;   // insert after this block, NULL means at the head
+    int policy = atomic_load_explicit(&placement_policy, memory_order_relaxed);
+    if (policy == PLACEMENT_LIFO) {
+        after = NULL;
+    } else if (policy == PLACEMENT_ADDRESS && h < tail) {
+        // only the address-ordered policy walks the bin, and only when h is not the highest block
+        after = NULL;
+        for (block_header* curr = head; curr && curr < h; curr = curr->next_block)
+            after = curr;
     }
-    curr->next_block = h;
-    h->prev_block = curr;
-    h->next_block = NULL;
+
+    h->prev_block = after;
+    h->next_block = after ? after->next_block : head;
+    if (h->next_block)
+        ((block_header*)h->next_block)->prev_block = h;
+    else
+        a->bin_tails[idx] = h;
+    if (after)
+        after->next_block = h;
+    else
+        a->free_bins[idx] = h;
     
 }
 
-// custom memset function
-void* memoryset(void* ptr, int c, size_t n) 
+//helper function to record when a large block became free, so purging can tell how long it sat unused
+static void stamp_free_block(block_header* h)
+{
+
+    h->is_purged = FALSE;
+    if (BLOCK_SIZE(h) >= PURGE_MIN)
+        h->freed_at = (uint32_t)now_ms();
+
+}
+
+//helper function to give a free block its footer and tell the block after it
+static void set_footer(block_header* h)
+{
+
+    block_header* next = NEXT_BLOCK(h);
+    ((block_footer*)((char*)next - BLOCK_FOOTER_SIZE))->size = BLOCK_SIZE(h);
+    next->size |= BLOCK_PREV_FREE;
+
+}
+
+//helper function to return the tail of an allocated block to the bins if it is big enough
+static void split_block(arena* a, block_header* h, size_t payload)
+{
+
+    size_t size = BLOCK_SIZE(h);
+    if (size - payload < MIN_BLOCK)
+        return;
+
+    h->size = payload | (h->size & BLOCK_PREV_FREE);
+
+    // new free block, merged with a free block that follows it
+    block_header* new_h = NEXT_BLOCK(h);
+    size_t new_payload = size - payload - BLOCK_HEADER_SIZE;
+    block_header* next = (block_header*)((char*)new_h + BLOCK_HEADER_SIZE + new_payload);
+    if ((next->size & BLOCK_FREE) && next != a->top) {
+        unlink_from_free_list(a, next);
+        new_payload += BLOCK_HEADER_SIZE + BLOCK_SIZE(next);
+    }
+    new_h->size = new_payload | BLOCK_FREE;
+    new_h->prev_block = new_h->next_block = NULL;
+
+    // a remainder next to the top chunk, or at the end of the heap, becomes the top chunk
+    next = NEXT_BLOCK(new_h);
+    if (next == a->top) {
+        new_h->size += BLOCK_HEADER_SIZE + BLOCK_SIZE(a->top);
+        a->top = new_h;
+        stamp_free_block(new_h);
+        return;
+    }
+    stamp_free_block(new_h);
+    if ((char*)next == a->heap_end - BLOCK_HEADER_SIZE) {
+        a->top = new_h;
+        return;
+    }
+
+    set_footer(new_h);
+    insert_into_free_list(a, new_h);
+
+}
+
+//helper function to fill with 8-byte stores, also the fallback for tails and CPUs without SIMD
+static void* memoryset_scalar(void* ptr, int c, size_t n)
 {
 
     if (!ptr) return ptr;
@@ -123,20 +659,10 @@ void* memoryset(void* ptr, int c, size_t n)
 
 }
 
-// custom memdup function (helper)
-void* memdup(const void* ptr, size_t size)
+//helper function to copy with 8-byte loads and stores, also the fallback for tails and CPUs without SIMD
+static void copy_scalar(unsigned char* dst, const unsigned char* src, size_t size)
 {
 
-    if (ptr == NULL || size == 0)
-        return NULL;
-
-    void* dup = memalloc(size);
-    if (!dup)
-        return NULL;
-
-    const unsigned char* src = ptr;
-    unsigned char* dst = dup;
-
     size_t i = 0;
     for (; i + 8 <= size; i += 8) {
         *(uint64_t*)(dst + i) = *(const uint64_t*)(src + i);
@@ -146,372 +672,2687 @@ void* memdup(const void* ptr, size_t size)
         dst[i] = src[i];
     }
 
-    return dup;
-
 }
 
-void* memalloc(size_t requested_size)
-{
-    if (requested_size == 0)
-        return NULL;
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(MEMALLOC_NO_SIMD)
 
-    pthread_mutex_lock(&lock);
-    void* user_ptr = NULL;
+/* SIMD versions of the fill and copy loops, one per instruction set, picked
+   once at load time through an ifunc resolver. Each writes the first and last
+   vector unaligned and everything in between with aligned stores, so heads
+   and tails cost two stores instead of a byte loop. Buffers of STREAM_THRESHOLD
+   bytes or more use non-temporal stores: a fill or copy that large would only
+   evict the working set from the cache. */
 
-    size_t prelim_size = BLOCK_HEADER_SIZE + requested_size + BLOCK_FOOTER_SIZE;
-    size_t total_size  = ROUND_UP(prelim_size, ALIGNMENT);
+//helper function to fill `n` >= 16 bytes with SSE2
+__attribute__((target("sse2")))
+static void set_sse2(unsigned char* d, int c, size_t n)
+{
 
-    size_t mmap_prelim = MMAP_HEADER_SIZE + requested_size;
-    size_t mmap_total  = ROUND_UP(mmap_prelim, ALIGNMENT);
+    __m128i v = _mm_set1_epi8((char)c);
+    _mm_storeu_si128((__m128i*)d, v);
+    _mm_storeu_si128((__m128i*)(d + n - 16), v);
+    unsigned char* p = (unsigned char*)ROUND_UP((uintptr_t)d + 1, 16);
+    unsigned char* end = d + n - 16;
+    if (n >= STREAM_THRESHOLD) {
+        for (; p < end; p += 16)
+            _mm_stream_si128((__m128i*)p, v);
+        _mm_sfence();
+        return;
+    }
+    for (; p + 64 <= end; p += 64) {
+        _mm_store_si128((__m128i*)p, v);
+        _mm_store_si128((__m128i*)(p + 16), v);
+        _mm_store_si128((__m128i*)(p + 32), v);
+        _mm_store_si128((__m128i*)(p + 48), v);
+    }
+    for (; p < end; p += 16)
+        _mm_store_si128((__m128i*)p, v);
 
-    if (mmap_total >= MMAP_THRESHOLD) // request mmap memory
-    {
-        void* mmap_mem = mmap(NULL, mmap_total,
-                              PROT_READ | PROT_WRITE,
-                              MAP_PRIVATE | MAP_ANONYMOUS,
-                              -1, 0);
-
-        if (mmap_mem == MAP_FAILED) {
-            perror("mmap");
-            pthread_mutex_unlock(&lock);
-            return NULL;
-        }
+}
+
+//helper function to fill `n` >= 32 bytes with AVX2
+__attribute__((target("avx2")))
+static void set_avx2(unsigned char* d, int c, size_t n)
+{
 
-        mmap_block_header* h = (mmap_block_header*)mmap_mem;
-        h->size = mmap_total - MMAP_HEADER_SIZE;
-        h->is_mmap = TRUE;
-        pthread_mutex_unlock(&lock);
-        return (char*)h + MMAP_HEADER_SIZE;
+    __m256i v = _mm256_set1_epi8((char)c);
+    _mm256_storeu_si256((__m256i*)d, v);
+    _mm256_storeu_si256((__m256i*)(d + n - 32), v);
+    unsigned char* p = (unsigned char*)ROUND_UP((uintptr_t)d + 1, 32);
+    unsigned char* end = d + n - 32;
+    if (n >= STREAM_THRESHOLD) {
+        for (; p < end; p += 32)
+            _mm256_stream_si256((__m256i*)p, v);
+        _mm_sfence();
+        return;
+    }
+    for (; p + 128 <= end; p += 128) {
+        _mm256_store_si256((__m256i*)p, v);
+        _mm256_store_si256((__m256i*)(p + 32), v);
+        _mm256_store_si256((__m256i*)(p + 64), v);
+        _mm256_store_si256((__m256i*)(p + 96), v);
     }
+    for (; p < end; p += 32)
+        _mm256_store_si256((__m256i*)p, v);
 
-    // Initialize heap if first allocation
-    if (heap_start == NULL)
-        heap_start = (void*)brk(0);
+}
 
-    if (free_list == NULL)
-    {
-        void* region = sbrk(PAGE_SIZE);
-        if (region == (void*)-1) {
-            perror("sbrk");
-            pthread_mutex_unlock(&lock);
-            return NULL;
-        }
-        heap_end = (char*)heap_start + PAGE_SIZE;
+//helper function to fill `n` >= 64 bytes with AVX-512
+__attribute__((target("avx512f")))
+static void set_avx512(unsigned char* d, int c, size_t n)
+{
 
-        block_header* h = (block_header*)region;
-        h->size = PAGE_SIZE - (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
-        h->is_free = TRUE;
-        h->prev_block = NULL;
-        h->next_block = NULL;
+    __m512i v = _mm512_set1_epi32((int)((unsigned char)c * 0x01010101u));
+    _mm512_storeu_si512((void*)d, v);
+    _mm512_storeu_si512((void*)(d + n - 64), v);
+    unsigned char* p = (unsigned char*)ROUND_UP((uintptr_t)d + 1, 64);
+    unsigned char* end = d + n - 64;
+    if (n >= STREAM_THRESHOLD) {
+        for (; p < end; p += 64)
+            _mm512_stream_si512((void*)p, v);
+        _mm_sfence();
+        return;
+    }
+    for (; p + 256 <= end; p += 256) {
+        _mm512_store_si512((void*)p, v);
+        _mm512_store_si512((void*)(p + 64), v);
+        _mm512_store_si512((void*)(p + 128), v);
+        _mm512_store_si512((void*)(p + 192), v);
+    }
+    for (; p < end; p += 64)
+        _mm512_store_si512((void*)p, v);
 
-        block_footer* f = (block_footer*)((char*)h + BLOCK_HEADER_SIZE + h->size);
-        f->size = h->size;
+}
+
+//helper function to copy `n` >= 16 bytes with SSE2
+__attribute__((target("sse2")))
+static void copy_sse2(unsigned char* d, const unsigned char* s, size_t n)
+{
 
-        free_list = h;
+    __m128i head = _mm_loadu_si128((const __m128i*)s);
+    __m128i tail = _mm_loadu_si128((const __m128i*)(s + n - 16));
+    unsigned char* p = (unsigned char*)ROUND_UP((uintptr_t)d + 1, 16);
+    unsigned char* end = d + n - 16;
+    const unsigned char* q = s + (p - d);
+    if (n >= STREAM_THRESHOLD) {
+        for (; p < end; p += 16, q += 16)
+            _mm_stream_si128((__m128i*)p, _mm_loadu_si128((const __m128i*)q));
+        _mm_sfence();
+    } else {
+        for (; p < end; p += 16, q += 16)
+            _mm_store_si128((__m128i*)p, _mm_loadu_si128((const __m128i*)q));
     }
+    _mm_storeu_si128((__m128i*)d, head);
+    _mm_storeu_si128((__m128i*)(d + n - 16), tail);
 
-retry_allocation:
+}
 
-    size_t user_payload = total_size - (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
-    block_header* curr = (block_header*)free_list;
+//helper function to copy `n` >= 32 bytes with AVX2
+__attribute__((target("avx2")))
+static void copy_avx2(unsigned char* d, const unsigned char* s, size_t n)
+{
 
-    while (curr)
-    {
-        if (curr->is_free && curr->size >= user_payload)
-        {
-            // Split if large enough
-            size_t remaining = curr->size - user_payload;
+    __m256i head = _mm256_loadu_si256((const __m256i*)s);
+    __m256i tail = _mm256_loadu_si256((const __m256i*)(s + n - 32));
+    unsigned char* p = (unsigned char*)ROUND_UP((uintptr_t)d + 1, 32);
+    unsigned char* end = d + n - 32;
+    const unsigned char* q = s + (p - d);
+    if (n >= STREAM_THRESHOLD) {
+        for (; p < end; p += 32, q += 32)
+            _mm256_stream_si256((__m256i*)p, _mm256_loadu_si256((const __m256i*)q));
+        _mm_sfence();
+    } else {
+        for (; p < end; p += 32, q += 32)
+            _mm256_store_si256((__m256i*)p, _mm256_loadu_si256((const __m256i*)q));
+    }
+    _mm256_storeu_si256((__m256i*)d, head);
+    _mm256_storeu_si256((__m256i*)(d + n - 32), tail);
 
-            if (remaining >= ROUND_UP(MIN_SPLIT, ALIGNMENT))
-            {
-                unlink_from_free_list(curr);
+}
 
-                size_t old_size = curr->size;
-                curr->is_free = FALSE;
-                curr->size = user_payload;
+//helper function to copy `n` >= 64 bytes with AVX-512
+__attribute__((target("avx512f")))
+static void copy_avx512(unsigned char* d, const unsigned char* s, size_t n)
+{
 
-                block_footer* alloc_footer =
-                    (block_footer*)((char*)curr + BLOCK_HEADER_SIZE + curr->size);
-                alloc_footer->size = curr->size;
+    __m512i head = _mm512_loadu_si512((const void*)s);
+    __m512i tail = _mm512_loadu_si512((const void*)(s + n - 64));
+    unsigned char* p = (unsigned char*)ROUND_UP((uintptr_t)d + 1, 64);
+    unsigned char* end = d + n - 64;
+    const unsigned char* q = s + (p - d);
+    if (n >= STREAM_THRESHOLD) {
+        for (; p < end; p += 64, q += 64)
+            _mm512_stream_si512((void*)p, _mm512_loadu_si512((const void*)q));
+        _mm_sfence();
+    } else {
+        for (; p < end; p += 64, q += 64)
+            _mm512_store_si512((void*)p, _mm512_loadu_si512((const void*)q));
+    }
+    _mm512_storeu_si512((void*)d, head);
+    _mm512_storeu_si512((void*)(d + n - 64), tail);
 
-                // new free block
-                block_header* new_h =
-                    (block_header*)((char*)alloc_footer + BLOCK_FOOTER_SIZE);
+}
 
-                size_t new_payload = old_size - user_payload -
-                                     (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
+// each level hands sizes below its vector width down to the next one
+static void* memoryset_sse2(void* ptr, int c, size_t n)
+{
+    if (!ptr) return ptr;
+    if (n < 16) return memoryset_scalar(ptr, c, n);
+    set_sse2(ptr, c, n);
+    return ptr;
+}
+static void* memoryset_avx2(void* ptr, int c, size_t n)
+{
+    if (!ptr) return ptr;
+    if (n < 32) return memoryset_sse2(ptr, c, n);
+    set_avx2(ptr, c, n);
+    return ptr;
+}
+static void* memoryset_avx512(void* ptr, int c, size_t n)
+{
+    if (!ptr) return ptr;
+    if (n < 64) return memoryset_avx2(ptr, c, n);
+    set_avx512(ptr, c, n);
+    return ptr;
+}
 
-                new_h->size = new_payload;
-                new_h->is_free = TRUE;
-                new_h->prev_block = new_h->next_block = NULL;
+static void copy_bytes_sse2(unsigned char* dst, const unsigned char* src, size_t size)
+{
+    if (size < 16) copy_scalar(dst, src, size);
+    else copy_sse2(dst, src, size);
+}
+static void copy_bytes_avx2(unsigned char* dst, const unsigned char* src, size_t size)
+{
+    if (size < 32) copy_bytes_sse2(dst, src, size);
+    else copy_avx2(dst, src, size);
+}
+static void copy_bytes_avx512(unsigned char* dst, const unsigned char* src, size_t size)
+{
+    if (size < 64) copy_bytes_avx2(dst, src, size);
+    else copy_avx512(dst, src, size);
+}
 
-                block_footer* new_f =
-                    (block_footer*)((char*)new_h + BLOCK_HEADER_SIZE + new_payload);
-                new_f->size = new_payload;
+typedef void* (*memoryset_fn)(void*, int, size_t);
+typedef void (*copy_bytes_fn)(unsigned char*, const unsigned char*, size_t);
 
-                insert_at_tail_free_list(new_h);
-                pthread_mutex_unlock(&lock);
-                return (char*)curr + BLOCK_HEADER_SIZE;
-            }
+// resolvers run while the program is being relocated, before any constructor
+static memoryset_fn resolve_memoryset(void)
+{
 
-            // No split
-            curr->is_free = FALSE;
-            curr->size = user_payload;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return memoryset_avx512;
+    if (__builtin_cpu_supports("avx2")) return memoryset_avx2;
+    return memoryset_sse2; // every x86-64 CPU has SSE2
 
-            block_footer* f =
-                (block_footer*)((char*)curr + BLOCK_HEADER_SIZE + curr->size);
-            f->size = curr->size;
+}
 
-            unlink_from_free_list(curr);
-            pthread_mutex_unlock(&lock);
-            return (char*)curr + BLOCK_HEADER_SIZE;
-        }
+static copy_bytes_fn resolve_copy_bytes(void)
+{
 
-        curr = curr->next_block;
-    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return copy_bytes_avx512;
+    if (__builtin_cpu_supports("avx2")) return copy_bytes_avx2;
+    return copy_bytes_sse2;
 
-    // No suitable block found - extend heap safely
-    void* region = sbrk(PAGE_SIZE);
-    if (region == (void*)-1) {
-        perror("sbrk failed");
-        pthread_mutex_unlock(&lock);
-        return NULL;
-    }
-    heap_end = (char*)heap_end + PAGE_SIZE;
+}
 
-    block_header* h = (block_header*)region;
-    h->size = PAGE_SIZE - (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
-    h->is_free = TRUE;
-    h->prev_block = h->next_block = NULL;
+// custom memset function, bound to the best version for this CPU
+void* memoryset(void* ptr, int c, size_t n) __attribute__((ifunc("resolve_memoryset")));
+static void copy_bytes(unsigned char* dst, const unsigned char* src, size_t size) __attribute__((ifunc("resolve_copy_bytes")));
 
-    block_footer* f = (block_footer*)((char*)h + BLOCK_HEADER_SIZE + h->size);
-    f->size = h->size;
+#else
 
-    insert_at_tail_free_list(h);
+// custom memset function
+void* memoryset(void* ptr, int c, size_t n)
+{
+    return memoryset_scalar(ptr, c, n);
+}
 
-    goto retry_allocation; // only retry after adding new free block
+static void copy_bytes(unsigned char* dst, const unsigned char* src, size_t size)
+{
+    copy_scalar(dst, src, size);
 }
 
-void* defalloc(size_t num_elements, size_t element_size)
+#endif
+
+// custom memdup function (helper)
+void* memdup(const void* ptr, size_t size)
 {
 
-    if (num_elements == 0 || element_size == 0){
-        return NULL;
-    }
-    if (num_elements > SIZE_MAX / element_size){ // overflow (too many elements)
+    if (ptr == NULL || size == 0)
         return NULL;
-    }
-    pthread_mutex_lock(&lock);
-    size_t total_size = num_elements * element_size;
-    void* ptr = memalloc(total_size);
-    if (!ptr) {
-        pthread_mutex_unlock(&lock);
+
+    void* dup = memalloc(size);
+    if (!dup)
         return NULL;
-    }
-    memoryset(ptr, 0, total_size); // set each byte to 0
-    pthread_mutex_unlock(&lock);
-    return ptr; 
+
+    copy_bytes(dup, ptr, size);
+    return dup;
 
 }
 
-void memfree(void* ptr)
+//helper function to read a monotonic clock in milliseconds
+static uint64_t now_ms(void)
 {
 
-    if (!ptr) return;
-    pthread_mutex_lock(&lock);
-    // detect mmap block safely
-    /* If ptr outside heap range, treat as mmap'ed block.
-       If heap_start/heap_end are not initialized, fall back to checking header flag (best-effort). */
-    if (heap_start && heap_end) {
-        if ((char*)ptr < (char*)heap_start || (char*)ptr >= (char*)heap_end) {
-            mmap_block_header* mh = (mmap_block_header*)((char*)ptr - MMAP_HEADER_SIZE);
-            if (mh->is_mmap == TRUE) {
-                size_t total = mh->size + MMAP_HEADER_SIZE;
-                if (munmap((void*)mh, total) == -1) {
-                    perror("munmap failed");
-                }
-                pthread_mutex_unlock(&lock);
-                return;
-            } else {
-                /* Not mmap - treat as heap block (defensive). */
-            }
-        }
-    } else {
-        /* heap bounds unknown: try to read header flag anyway */
-        mmap_block_header* mh = (mmap_block_header*)((char*)ptr - MMAP_HEADER_SIZE);
-        if (mh->is_mmap == TRUE) {
-            size_t total = mh->size + MMAP_HEADER_SIZE;
-            if (munmap((void*)mh, total) == -1) {
-                perror("munmap failed");
-            }
-            pthread_mutex_unlock(&lock);
-            return;
-        }
-    }
-
-    // handle heap region
-    block_header* hdr = (block_header*)((char*)ptr - BLOCK_HEADER_SIZE);
-
-    // mark it free 
-    hdr->is_free = TRUE;
-
-    block_footer* left_ftr = NULL;
-    block_header* right_hdr = NULL;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
 
-    if (heap_start && (char*)hdr > (char*)heap_start + BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE)
-        left_ftr = (block_footer*)((char*)hdr - BLOCK_FOOTER_SIZE);
+}
 
-    if (heap_end && (char*)hdr + BLOCK_HEADER_SIZE + hdr->size + BLOCK_FOOTER_SIZE < (char*)heap_end)
-        right_hdr = (block_header*)((char*)hdr + BLOCK_HEADER_SIZE + hdr->size + BLOCK_FOOTER_SIZE);
+//helper function to unmap cached chunks that have gone unused too long (or all), caller holds mmap_cache_lock
+static size_t mmap_cache_expire(uint64_t now, bool all)
+{
 
-    // check whether left_ftr and right_hdr are inside heap region 
-    bool has_left = (heap_start && heap_end) &&
-                    ((char*)left_ftr >= (char*)heap_start) && ((char*)left_ftr < (char*)heap_end);
+    size_t released = 0;
+    for (size_t i = 0; i < MMAP_CACHE_SLOTS; i++) {
+        mmap_cache_entry* e = &mmap_cache[i];
+        if (e->base && (all || now - e->stamp >= MMAP_CACHE_AGE_MS)) {
+            munmap(e->base, e->len);
+            mmap_cached_bytes -= e->len;
+            released += e->len;
+            e->base = NULL;
+        }
+    }
+    return released;
 
-    bool has_right = (heap_start && heap_end) &&
-                     ((char*)right_hdr >= (char*)heap_start) && ((char*)right_hdr < (char*)heap_end);
+}
 
-    block_header* new_hdr = hdr;
-    size_t new_payload = hdr->size;
+//helper function to take the smallest cached chunk of at least `len` bytes, NULL if none is close enough
+static mmap_cache_entry mmap_cache_take(size_t len)
+{
 
-    if (has_left) {
-        /* recover left header using left footer's stored payload size */
-        size_t left_payload = left_ftr->size;
-        block_header* left_hdr = (block_header*)((char*)left_ftr - BLOCK_HEADER_SIZE - left_payload);
+    mmap_cache_entry found = { NULL, 0, 0 };
+    pthread_mutex_lock(&mmap_cache_lock);
+    mmap_cache_expire(now_ms(), FALSE);
 
-        if ((char*)left_hdr >= (char*)heap_start && (char*)left_hdr < (char*)heap_end && left_hdr->is_free) {
-            unlink_from_free_list(left_hdr);
-            new_payload = left_hdr->size + new_payload + (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
-            new_hdr = left_hdr;
-        }
+    mmap_cache_entry* best = NULL;
+    for (size_t i = 0; i < MMAP_CACHE_SLOTS; i++) {
+        mmap_cache_entry* e = &mmap_cache[i];
+        if (e->base && e->len >= len && e->len - len <= len / MMAP_CACHE_SLACK &&
+            (!best || e->len < best->len))
+            best = e;
     }
-
-    if (has_right) {
-        if (right_hdr->is_free) {
-            unlink_from_free_list(right_hdr);
-            new_payload = new_payload + right_hdr->size + (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
-        }
+    if (best) {
+        found = *best;
+        mmap_cached_bytes -= best->len;
+        best->base = NULL;
     }
 
-    new_hdr->size = new_payload;
-    new_hdr->is_free = TRUE;
+    pthread_mutex_unlock(&mmap_cache_lock);
+    return found;
 
-    block_footer* new_ftr = (block_footer*)((char*)new_hdr + BLOCK_HEADER_SIZE + new_payload);
-    new_ftr->size = new_payload;
-    if (!new_hdr->prev_block && !new_hdr->next_block) {
-        insert_at_tail_free_list(new_hdr);
-    }
-    pthread_mutex_unlock(&lock);
 }
 
-void* memresize(void* ptr, size_t new_size)
+//helper function to cache a freed mapping, unmapping it or the oldest entry when the cache is full
+static void mmap_cache_put(void* base, size_t len)
 {
-    // Case 1: null pointer allocate new block
-    if (!ptr) return memalloc(new_size);
 
-    // Case 2: requested size is 0 free block
-    if (new_size == 0) {
-        memfree(ptr);
-        return NULL;
+    if (len > MMAP_CACHE_MAX_CHUNK) {
+        munmap(base, len);
+        return;
     }
-    pthread_mutex_lock(&lock);
-    block_header* hdr = (block_header*)((char*)ptr - BLOCK_HEADER_SIZE);
-    size_t old_size = hdr->size;
-    size_t required_size = ROUND_UP(new_size, ALIGNMENT);
 
-    // Case 3: requested size equals current size  return ptr
-    if (required_size == old_size){
-        pthread_mutex_unlock(&lock);
-        return ptr;
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&mmap_cache_lock);
+    mmap_cache_expire(now, FALSE);
+
+    // make room by evicting the oldest entries
+    while (1) {
+        mmap_cache_entry* slot = NULL;
+        mmap_cache_entry* oldest = NULL;
+        for (size_t i = 0; i < MMAP_CACHE_SLOTS; i++) {
+            mmap_cache_entry* e = &mmap_cache[i];
+            if (!e->base) {
+                if (!slot) slot = e;
+            } else if (!oldest || e->stamp < oldest->stamp) {
+                oldest = e;
+            }
+        }
+        if (slot && mmap_cached_bytes + len <= mmap_cache_max) {
+            slot->base = base;
+            slot->len = len;
+            slot->stamp = now;
+            mmap_cached_bytes += len;
+            break;
+        }
+        if (!oldest) { // cache is empty and the chunk still does not fit
+            munmap(base, len);
+            break;
+        }
+        munmap(oldest->base, oldest->len);
+        mmap_cached_bytes -= oldest->len;
+        oldest->base = NULL;
     }
 
-    if (required_size < old_size) {
-        size_t leftover = old_size - required_size;
+    pthread_mutex_unlock(&mmap_cache_lock);
 
-        if (leftover >= ROUND_UP(MIN_SPLIT, ALIGNMENT)) {
-            // shrink current block
-            hdr->size = required_size;
+}
 
-            // update footer of allocated block
-            block_footer* alloc_ftr = (block_footer*)((char*)hdr + BLOCK_HEADER_SIZE + required_size);
-            alloc_ftr->size = required_size;
+// helper function to map a dedicated region for large requests
+static void* mmap_alloc(size_t requested_size, size_t alignment, zero_span* zs)
+{
 
-            // create new free block from leftover
-            block_header* new_free = (block_header*)((char*)alloc_ftr + BLOCK_FOOTER_SIZE);
-            new_free->size = leftover - (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
-            new_free->is_free = TRUE;
-            new_free->prev_block = new_free->next_block = NULL;
+    // the payload is aligned inside the mapping, so leave room to slide it forward
+    size_t mmap_prelim = MMAP_HEADER_SIZE + requested_size + (alignment > ALIGNMENT ? alignment : 0);
+    size_t mmap_total  = ROUND_UP(mmap_prelim, OS_PAGE_SIZE);
+
+    // a recently freed chunk of about the right size saves the syscall and the page faults;
+    // a huge alignment always gets a fresh mapping, since its leading pages are unmapped below
+    mmap_cache_entry cached = { NULL, 0, 0 };
+    if (alignment <= MAX_ALIGNMENT)
+        cached = mmap_cache_take(mmap_total);
+    void* mmap_mem = cached.base;
+    if (mmap_mem) {
+        mmap_total = cached.len;
+    } else if (alignment > MAX_ALIGNMENT) {
+        // only reserved, like an arena heap; the part that is kept is committed below
+        mmap_mem = mmap(NULL, mmap_total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    } else {
+        mmap_mem = mmap(NULL, mmap_total,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    }
 
-            block_footer* free_ftr = (block_footer*)((char*)new_free + BLOCK_HEADER_SIZE + new_free->size);
-            free_ftr->size = new_free->size;
+    if (mmap_mem == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
 
-            // insert leftover into free list
-            insert_at_tail_free_list(new_free);
+    uintptr_t payload = ROUND_UP((uintptr_t)mmap_mem + MMAP_HEADER_SIZE, alignment);
+    if (alignment > MAX_ALIGNMENT) {
+        // the pages in front of the header, and any past the payload, go back at once
+        size_t lead = (payload - MMAP_HEADER_SIZE - (uintptr_t)mmap_mem) & ~((size_t)OS_PAGE_SIZE - 1);
+        size_t keep = ROUND_UP(payload + requested_size - (uintptr_t)mmap_mem - lead, OS_PAGE_SIZE);
+        if (lead)
+            munmap(mmap_mem, lead);
+        mmap_mem = (char*)mmap_mem + lead;
+        if (mmap_total - lead > keep)
+            munmap((char*)mmap_mem + keep, mmap_total - lead - keep);
+        mmap_total = keep;
+        if (mprotect(mmap_mem, mmap_total, PROT_READ | PROT_WRITE) == -1) {
+            munmap(mmap_mem, mmap_total);
+            return NULL;
         }
-        pthread_mutex_unlock(&lock);
-        return ptr;
     }
+    mmap_block_header* h = (mmap_block_header*)(payload - MMAP_HEADER_SIZE);
+    h->offset = (uint32_t)((char*)h - (char*)mmap_mem);
+    h->size = mmap_total - h->offset - MMAP_HEADER_SIZE;
+    h->is_mmap = TRUE;
+    atomic_fetch_add_explicit(&mmap_live_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mmap_live_bytes, mmap_total, memory_order_relaxed);
+
+    // a new mapping is zero-filled by the kernel, a cached one holds whatever it held before
+    if (zs && !cached.base) {
+        zs->from = (char*)h + MMAP_HEADER_SIZE;
+        zs->to = zs->from + h->size;
+    }
+    return (char*)h + MMAP_HEADER_SIZE;
 
-    block_header* right_hdr = (block_header*)((char*)hdr + BLOCK_HEADER_SIZE + old_size + BLOCK_FOOTER_SIZE);
-    bool has_right = (heap_start && heap_end) &&
-                    ((char*)right_hdr >= (char*)heap_start) &&
-                    ((char*)right_hdr < (char*)heap_end);
+}
 
-    // attempt in-place expansion by merging with right free block
-    if (has_right && right_hdr->is_free) {
-        size_t merged_payload = old_size + right_hdr->size + BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE;
+//helper function to release an mmap'ed chunk and adapt the mmap threshold to its size
+static void mmap_free(mmap_block_header* mh)
+{
 
-        if (merged_payload >= required_size) {
-            // unlink right block from free list
-            unlink_from_free_list(right_hdr);
+    size_t total = mh->offset + MMAP_HEADER_SIZE + mh->size;
+    atomic_fetch_sub_explicit(&mmap_live_count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&mmap_live_bytes, total, memory_order_relaxed);
 
-            // expand current block
-            hdr->size = merged_payload;
+    // a chunk this size was worth freeing, so later ones go to the heap (glibc's dynamic threshold)
+    if (total > atomic_load_explicit(&mmap_threshold, memory_order_relaxed) &&
+        total <= MMAP_THRESHOLD_MAX && !atomic_load_explicit(&mmap_threshold_fixed, memory_order_relaxed)) {
+        atomic_store_explicit(&mmap_threshold, total, memory_order_relaxed);
+        if (2 * total > TRIM_THRESHOLD)
+            atomic_store_explicit(&trim_threshold, 2 * total, memory_order_relaxed);
+    }
 
-            block_footer* ftr = (block_footer*)((char*)hdr + BLOCK_HEADER_SIZE + hdr->size);
-            ftr->size = hdr->size;
+    mmap_cache_put((char*)mh - mh->offset, total);
 
-            // split leftover if any
-            size_t leftover = merged_payload - required_size;
-            if (leftover >= ROUND_UP(MIN_SPLIT, ALIGNMENT)) {
-                hdr->size = required_size;
+}
 
-                // new footer for allocated block
-                block_footer* alloc_ftr = (block_footer*)((char*)hdr + BLOCK_HEADER_SIZE + required_size);
-                alloc_ftr->size = required_size;
+//helper function to stamp a traced resize between getting the new block and releasing the old one
+static inline void resize_stamp(uint64_t* stamp)
+{
+    if (stamp)
+        *stamp = trace_now();
+}
 
-                // leftover free block
-                block_header* new_free = (block_header*)((char*)alloc_ftr + BLOCK_FOOTER_SIZE);
-                new_free->size = leftover - (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
-                new_free->is_free = TRUE;
-                new_free->prev_block = new_free->next_block = NULL;
+//helper function to resize an mmap'ed chunk by remapping its pages instead of copying them, `stamp` as for resize_block
+static void* mmap_resize(void* ptr, size_t new_size, uint64_t* stamp)
+{
 
-                block_footer* free_ftr = (block_footer*)((char*)new_free + BLOCK_HEADER_SIZE + new_free->size);
-                free_ftr->size = new_free->size;
+    mmap_block_header* mh = (mmap_block_header*)((char*)ptr - MMAP_HEADER_SIZE);
+    size_t offset = mh->offset;
+    size_t old_total = offset + MMAP_HEADER_SIZE + mh->size;
+    size_t new_total = ROUND_UP(offset + MMAP_HEADER_SIZE + new_size, OS_PAGE_SIZE);
+    if (new_total == old_total)
+        return ptr;
 
-                insert_at_tail_free_list(new_free);
-            }
-            pthread_mutex_unlock(&lock);
-            return ptr; 
-        }
+    // below the threshold (it shrank, or the threshold rose since), it belongs on the heap now
+    if (ROUND_UP(MMAP_HEADER_SIZE + new_size, ALIGNMENT) < atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+        void* new_ptr = memalloc(new_size);
+        if (!new_ptr)
+            return NULL;
+        memcpy(new_ptr, ptr, new_size < mh->size ? new_size : mh->size);
+        resize_stamp(stamp);
+        memfree(ptr);
+        return new_ptr;
     }
 
-    pthread_mutex_unlock(&lock);
-
-    void* new_ptr = memalloc(required_size);
-    if (!new_ptr){
+    // the kernel moves the page mappings, the contents are never copied
+    void* moved = mremap((char*)mh - offset, old_total, new_total, MREMAP_MAYMOVE);
+    if (moved == MAP_FAILED) {
+        perror("mremap");
         return NULL;
     }
+    resize_stamp(stamp); // the kernel swaps the ranges at once, this is as close as it gets
+    mh = (mmap_block_header*)((char*)moved + offset);
+    stats_free(mh->size);
+    mh->size = new_total - offset - MMAP_HEADER_SIZE;
+    stats_alloc(new_size, mh->size);
+    atomic_fetch_add_explicit(&mmap_live_bytes, new_total - old_total, memory_order_relaxed); // wraps on shrink
+    return (char*)mh + MMAP_HEADER_SIZE;
 
-    // copy old content
-    memcpy(new_ptr, ptr, old_size);
+}
 
-    // free old block
-    memfree(ptr);
-    return new_ptr;
+//helper function to find the arena whose heap contains `ptr`, NULL for mmap'ed blocks
+static arena* arena_for_ptr(const void* ptr)
+{
+
+    // arenas are never torn down, so their ranges can be read without a lock
+    size_t n = atomic_load_explicit(&arena_count, memory_order_acquire);
+    for (size_t i = 0; i < n; i++) {
+        arena* a = &arenas[i];
+        if ((const char*)ptr >= a->heap_start && (const char*)ptr < a->heap_limit)
+            return a;
+    }
+    return NULL;
 
 }
 
+/* fork() copies only the calling thread, so a lock held by any other thread
+   would stay held in the child forever. Every allocator lock is taken before
+   the fork, in the order the allocator nests them, and released afterwards. */
+static void fork_prepare(void)
+{
 
+    pthread_mutex_lock(&arena_init_lock);
+    size_t n = atomic_load_explicit(&arena_count, memory_order_acquire);
+    for (size_t i = 0; i < n; i++)
+        pthread_mutex_lock(&arenas[i].lock);
+    pthread_mutex_lock(&slab_lock);
+    pthread_mutex_lock(&mmap_cache_lock);
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&prof_lock);
+    pthread_mutex_lock(&trace_lock);
 
+}
 
+static void fork_parent(void)
+{
+
+    pthread_mutex_unlock(&trace_lock);
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_unlock(&mmap_cache_lock);
+    pthread_mutex_unlock(&slab_lock);
+    size_t n = atomic_load_explicit(&arena_count, memory_order_acquire);
+    for (size_t i = n; i > 0; i--)
+        pthread_mutex_unlock(&arenas[i - 1].lock);
+    pthread_mutex_unlock(&arena_init_lock);
+
+}
+
+// the child is single-threaded, its copies of the locks are simply reset
+static void fork_child(void)
+{
+
+    pthread_mutex_init(&trace_lock, NULL);
+    pthread_mutex_init(&prof_lock, NULL);
+    pthread_mutex_init(&stats_lock, NULL);
+    pthread_mutex_init(&mmap_cache_lock, NULL);
+    pthread_mutex_init(&slab_lock, NULL);
+    size_t n = atomic_load_explicit(&arena_count, memory_order_acquire);
+    for (size_t i = 0; i < n; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    pthread_mutex_init(&arena_init_lock, NULL);
+
+    // the trace belongs to the parent, the child neither writes to it nor repeats the parent's events
+    if (TRACE_ACTIVE()) {
+        atomic_fetch_and(&alloc_hooks, ~(unsigned)HOOK_TRACE);
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    for (trace_buffer* b = trace_buffers; b; b = b->next) {
+        atomic_store_explicit(&b->in_use, 0, memory_order_relaxed);
+        b->count = 0;
+    }
+
+}
+
+static void arena_setup(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    arena_limit = cpus > 0 ? (size_t)cpus * 2 : 2;
+    if (arena_limit > MAX_ARENAS)
+        arena_limit = MAX_ARENAS;
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+//helper function to reserve the address range of a new arena, caller holds arena_init_lock
+static bool arena_init(arena* a)
+{
+
+    // reserve without committing; heap growth makes pages accessible as it goes.
+    // under an address space limit, settle for a smaller range
+    size_t reserve = ARENA_RESERVE;
+    char* region = MAP_FAILED;
+    while (reserve >= ARENA_MIN_RESERVE) {
+        region = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region != MAP_FAILED)
+            break;
+        reserve >>= 1;
+    }
+    if (region == MAP_FAILED) {
+        perror("mmap arena");
+        return FALSE;
+    }
+
+    pthread_mutex_init(&a->lock, NULL);
+    a->heap_start = a->heap_end = a->clean_from = region;
+    a->heap_limit = region + reserve;
+    return TRUE;
+
+}
+
+//helper function to pick the arena the calling thread allocates from
+static arena* get_thread_arena(void)
+{
+
+    if (thread_arena)
+        return thread_arena;
+
+    pthread_once(&arena_once, arena_setup);
+    size_t idx = atomic_fetch_add(&next_arena, 1) % arena_limit;
+
+    // arenas are created in index order, so arena_count only ever grows by one
+    if (idx >= atomic_load_explicit(&arena_count, memory_order_acquire)) {
+        pthread_mutex_lock(&arena_init_lock);
+        size_t n = atomic_load_explicit(&arena_count, memory_order_relaxed);
+        while (n <= idx && arena_init(&arenas[n]))
+            atomic_store_explicit(&arena_count, ++n, memory_order_release);
+        pthread_mutex_unlock(&arena_init_lock);
+        if (n == 0)
+            return NULL;
+        if (idx >= n)
+            idx = n - 1; // out of address space, share the newest arena
+    }
+
+    thread_arena = &arenas[idx];
+    return thread_arena;
+
+}
+
+//helper function to grow an arena's heap by `increment` bytes, sbrk-style
+static void* arena_sbrk(arena* a, size_t increment)
+{
+
+    if (increment > (size_t)(a->heap_limit - a->heap_end))
+        return (void*)-1;
+    if (mprotect(a->heap_end, increment, PROT_READ | PROT_WRITE) == -1)
+        return (void*)-1;
+    void* old_end = a->heap_end;
+    a->heap_end += increment;
+
+    size_t total = atomic_fetch_add_explicit(&heap_committed, increment, memory_order_relaxed) + increment;
+    size_t peak = atomic_load_explicit(&heap_peak, memory_order_relaxed);
+    while (total > peak && !atomic_compare_exchange_weak_explicit(&heap_peak, &peak, total,
+                                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+    return old_end;
+
+}
+
+//helper function to pick how much to grow the heap by: an eighth of its size, kept within bounds
+static size_t growth_granule(arena* a)
+{
+
+    size_t heap_size = (size_t)(a->heap_end - a->heap_start);
+    size_t granule = atomic_load_explicit(&grow_size, memory_order_relaxed);
+    while (granule < heap_size / 8 && granule < MAX_GROW_GRANULE)
+        granule <<= 1;
+    return granule;
+
+}
+
+//helper function to move clean_from past the top chunk's header once everything below it may have been written
+static void mark_top_dirty(arena* a)
+{
+
+    char* written = a->top ? (char*)a->top + sizeof(block_header) : a->heap_end;
+    if (a->clean_from < written)
+        a->clean_from = written;
+
+}
+
+//helper function to make sure the top chunk can hold `payload` bytes, caller holds a->lock
+static bool grow_top(arena* a, size_t payload)
+{
+
+    size_t have = a->top ? BLOCK_SIZE(a->top) : 0;
+    if (have >= payload)
+        return TRUE;
+
+    // a new top chunk needs its header, the very first one also the 8 bytes that align it and the fence
+    size_t need = payload - have;
+    if (!a->top)
+        need += a->heap_end == a->heap_start ? 3 * BLOCK_HEADER_SIZE : BLOCK_HEADER_SIZE;
+
+    // grow by at least the shortfall, rounded to a granule that scales with the heap
+    size_t increment = ROUND_UP(need, growth_granule(a));
+    char* region = arena_sbrk(a, increment);
+    if (region == (void*)-1) {
+        increment = ROUND_UP(need, PAGE_SIZE); // near the end of the reservation
+        region = arena_sbrk(a, increment);
+    }
+    if (region == (void*)-1)
+        return FALSE;
+
+    // new memory is merged into the top chunk rather than becoming a block of its own,
+    // the old fence turns into payload and the new one is already zero
+    if (a->top) {
+        a->top->size += increment;
+    } else {
+        // without a top chunk, the new one starts where the fence was
+        block_header* h = (block_header*)(region == a->heap_start ? region + BLOCK_HEADER_SIZE :
+                                                                    region - BLOCK_HEADER_SIZE);
+        h->size = (size_t)(a->heap_end - BLOCK_HEADER_SIZE - ((char*)h + BLOCK_HEADER_SIZE)) | BLOCK_FREE;
+        h->prev_block = h->next_block = NULL;
+        stamp_free_block(h);
+        h->is_purged = TRUE; // never touched, so not resident yet
+        a->top = h;
+        mark_top_dirty(a);
+    }
+    return TRUE;
+
+}
+
+//helper function to give the unused end of the heap back to the OS, caller holds a->lock
+static size_t trim_top(arena* a)
+{
+
+    size_t top_bytes = BLOCK_HEADER_SIZE + BLOCK_SIZE(a->top);
+    if (top_bytes <= TOP_PAD + PAGE_SIZE)
+        return 0;
+
+    size_t release = (top_bytes - TOP_PAD) & ~((size_t)PAGE_SIZE - 1);
+    char* new_end = a->heap_end - release;
+    madvise(new_end, release, MADV_DONTNEED);
+    if (mprotect(new_end, release, PROT_NONE) == -1)
+        return 0;
+    a->heap_end = new_end;
+    atomic_fetch_sub_explicit(&heap_committed, release, memory_order_relaxed);
+    if (a->clean_from > new_end)
+        a->clean_from = new_end; // decommitted pages come back zero
+    a->top->size -= release;
+    *(size_t*)(new_end - BLOCK_HEADER_SIZE) = 0; // the new fence
+    return release;
+
+}
+
+//helper function to find the whole pages of a free block between its bookkeeping and its footer
+static void purgeable_pages(block_header* h, char** from, char** to)
+{
+
+    *from = (char*)ROUND_UP((uintptr_t)h + sizeof(block_header), OS_PAGE_SIZE);
+    *to = (char*)(((uintptr_t)NEXT_BLOCK(h) - BLOCK_FOOTER_SIZE) & ~((uintptr_t)OS_PAGE_SIZE - 1));
+
+}
+
+//helper function to release the whole pages inside a free block, keeping its header and footer resident
+static size_t purge_block(block_header* h)
+{
+
+    char* from;
+    char* to;
+    purgeable_pages(h, &from, &to);
+    h->is_purged = TRUE;
+    if (to <= from)
+        return 0;
+    madvise(from, (size_t)(to - from), MADV_DONTNEED);
+    return (size_t)(to - from);
+
+}
+
+//helper function to purge the large free blocks of an arena, all of them or those past their decay time
+static size_t purge_arena(arena* a, uint32_t now, bool all)
+{
+
+    size_t released = 0;
+    uint32_t decay = atomic_load_explicit(&purge_decay_ms, memory_order_relaxed);
+    for (size_t i = next_nonempty_bin(a, bin_index(PURGE_MIN)); i < NBINS; i = next_nonempty_bin(a, i + 1)) {
+        for (block_header* b = a->free_bins[i]; b; b = b->next_block) {
+            if (BLOCK_SIZE(b) >= PURGE_MIN && !b->is_purged && (all || now - b->freed_at >= decay))
+                released += purge_block(b);
+        }
+    }
+
+    block_header* t = a->top;
+    if (t && BLOCK_SIZE(t) >= PURGE_MIN && !t->is_purged && (all || now - t->freed_at >= decay)) {
+        released += purge_block(t);
+
+        // purged pages that reach the clean part make everything above them clean again
+        char* from;
+        char* to;
+        purgeable_pages(t, &from, &to);
+        if (from < to && to >= a->clean_from && from < a->clean_from)
+            a->clean_from = from;
+    }
+
+    a->last_purge = now;
+    return released;
+
+}
+
+//helper function to run a decay purge now and then as frees come in, caller holds a->lock
+static void maybe_purge(arena* a, bool large_free)
+{
+
+    if (!large_free && ++a->purge_tick < PURGE_CHECK_EVERY)
+        return;
+    a->purge_tick = 0;
+
+    uint32_t now = (uint32_t)now_ms();
+    if (now - a->last_purge >= PURGE_INTERVAL_MS)
+        purge_arena(a, now, FALSE);
+
+}
+
+//helper function to check whether a pointer lies in the slab region
+static bool in_slab(const void* ptr)
+{
+    return slab_region_start &&
+           (const char*)ptr >= slab_region_start &&
+           (const char*)ptr < slab_region_end;
+}
+
+//helper function to reserve the address range slabs are carved from
+static bool slab_region_init(void)
+{
+
+    // reserve without committing; each slab is made accessible when it is first used
+    char* region = mmap(NULL, SLAB_REGION_SIZE + SLAB_SIZE, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap slab region");
+        return FALSE;
+    }
+
+    // slabs are aligned to SLAB_SIZE so memfree can find one by masking the pointer
+    slab_region_start = (char*)ROUND_UP((uintptr_t)region, SLAB_SIZE);
+    slab_region_end = slab_region_start + SLAB_REGION_SIZE;
+    slab_region_next = slab_region_start;
+    return TRUE;
+
+}
+
+//helper function to take an unused slab from the shared pool or the region
+static slab* slab_take(bool* fresh)
+{
+
+    pthread_mutex_lock(&slab_lock);
+    slab* sl = slab_empty;
+    *fresh = FALSE;
+    if (sl) {
+        slab_empty = sl->next;
+    } else if ((slab_region_start || slab_region_init()) && slab_region_next != slab_region_end) {
+        if (mprotect(slab_region_next, SLAB_SIZE, PROT_READ | PROT_WRITE) == -1) {
+            perror("mprotect slab");
+        } else {
+            sl = (slab*)slab_region_next;
+            slab_region_next += SLAB_SIZE;
+            *fresh = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+    return sl; // NULL once the region is exhausted, caller falls back to the heap
+
+}
+
+//helper function to get an empty slab for size class `cls`, caller holds a->lock
+static slab* slab_new(arena* a, size_t cls)
+{
+
+    bool fresh;
+    slab* sl = slab_take(&fresh);
+    if (!sl)
+        return NULL;
+
+    sl->owner = a;
+    sl->obj_size = (uint32_t)((cls + 1) * ALIGNMENT);
+    sl->size_class = (uint32_t)cls;
+    sl->capacity = (uint32_t)((SLAB_SIZE - SLAB_HEADER_SIZE) / sl->obj_size);
+    sl->used = 0;
+    sl->free_objs = NULL;
+    sl->bump = (char*)sl + SLAB_HEADER_SIZE;
+    sl->bump_zero = fresh;
+
+    sl->prev = NULL;
+    sl->next = a->slab_partial[cls];
+    if (sl->next)
+        sl->next->prev = sl;
+    a->slab_partial[cls] = sl;
+    return sl;
+
+}
+
+//helper function to take an object of size class `cls` from a slab, caller holds a->lock
+static void* slab_alloc(arena* a, size_t cls, zero_span* zs)
+{
+
+    slab* sl = a->slab_partial[cls];
+    if (!sl && !(sl = slab_new(a, cls)))
+        return NULL;
+
+    void* obj;
+    if (sl->free_objs) {
+        obj = sl->free_objs;
+        sl->free_objs = *(void**)obj;
+    } else {
+        // objects that were never handed out are taken in address order
+        obj = sl->bump;
+        sl->bump += sl->obj_size;
+        if (zs && sl->bump_zero) {
+            zs->from = obj;
+            zs->to = sl->bump;
+        }
+    }
+
+    // a full slab leaves the partial list until an object comes back
+    if (++sl->used == sl->capacity) {
+        a->slab_partial[cls] = sl->next;
+        if (sl->next)
+            sl->next->prev = NULL;
+        sl->prev = sl->next = NULL;
+    }
+    return obj;
+
+}
+
+//helper function to return an object to its slab, caller holds the owner's lock
+static void slab_free(void* obj)
+{
+
+    slab* sl = SLAB_OF(obj);
+    arena* a = sl->owner;
+    size_t cls = sl->size_class;
+
+    if (sl->used == sl->capacity) {
+        sl->prev = NULL;
+        sl->next = a->slab_partial[cls];
+        if (sl->next)
+            sl->next->prev = sl;
+        a->slab_partial[cls] = sl;
+    }
+
+    *(void**)obj = sl->free_objs;
+    sl->free_objs = obj;
+    sl->used--;
+
+    // an empty slab is handed to the shared pool unless it is the last one of its class
+    if (sl->used == 0 && (a->slab_partial[cls] != sl || sl->next)) {
+        if (sl->prev)
+            sl->prev->next = sl->next;
+        else
+            a->slab_partial[cls] = sl->next;
+        if (sl->next)
+            sl->next->prev = sl->prev;
+        sl->prev = NULL;
+        pthread_mutex_lock(&slab_lock);
+        sl->next = slab_empty;
+        slab_empty = sl;
+        pthread_mutex_unlock(&slab_lock);
+    }
+
+}
+
+//helper function to find the arena that owns a slab object or heap block
+static arena* block_owner(void* ptr)
+{
+    return in_slab(ptr) ? SLAB_OF(ptr)->owner : arena_for_ptr(ptr);
+}
+
+//helper function to release a block to the slab it came from or to the heap, caller holds a->lock
+static void release_block(arena* a, void* ptr)
+{
+    if (in_slab(ptr))
+        slab_free(ptr);
+    else
+        heap_free(a, (block_header*)((char*)ptr - BLOCK_HEADER_SIZE));
+}
+
+//helper function to release a chain of cached blocks, locking each owning arena once per run
+static void release_chain(tcache_entry* e)
+{
+
+    arena* locked = NULL;
+    while (e) {
+        tcache_entry* next = e->next;
+        arena* owner = block_owner(e);
+
+        // a run of blocks from another thread's arena is pushed onto its remote stack in one go
+        if (owner != thread_arena) {
+            tcache_entry* last = e;
+            size_t count = 1;
+            while (last->next && block_owner(last->next) == owner) {
+                last = last->next;
+                count++;
+            }
+            next = last->next;
+            if (locked) // remote_free may take owner's lock, never hold two
+                pthread_mutex_unlock(&locked->lock);
+            locked = NULL;
+            remote_free(owner, e, last, count);
+            e = next;
+            continue;
+        }
+
+        if (owner != locked) {
+            if (locked)
+                pthread_mutex_unlock(&locked->lock);
+            arena_lock(owner);
+            locked = owner;
+        }
+        release_block(owner, e);
+        e = next;
+    }
+    if (locked)
+        pthread_mutex_unlock(&locked->lock);
+
+}
+
+// thread exit destructor: hand every cached block back to the heap
+static void tcache_drain(void* arg)
+{
+
+    tcache* tc = (tcache*)arg;
+    for (size_t i = 0; i < TCACHE_BINS; i++) {
+        tcache_entry* chain = tc->entries[i];
+        tc->entries[i] = NULL;
+        tc->counts[i] = 0;
+        release_chain(chain);
+    }
+    tc->disabled = TRUE;
+
+}
+
+static void tcache_create_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_drain);
+}
+
+// flush a bin down to `keep` entries, returning the rest to the free list
+static void tcache_flush(tcache* tc, size_t bin, unsigned keep)
+{
+
+    // detach the oldest entries, which sit behind the `keep` most recent ones
+    tcache_entry* last_kept = NULL;
+    tcache_entry* chain = tc->entries[bin];
+    for (unsigned i = 0; i < keep && chain; i++) {
+        last_kept = chain;
+        chain = chain->next;
+    }
+    if (last_kept)
+        last_kept->next = NULL;
+    else
+        tc->entries[bin] = NULL;
+    tc->counts[bin] = (uint16_t)keep;
+    release_chain(chain);
+
+}
+
+static void* tcache_get(size_t requested_size)
+{
+
+    tcache* tc = &thread_cache;
+    size_t bin = SIZE_CLASS(requested_size);
+    tcache_entry* e = tc->entries[bin];
+    if (!e) return NULL;
+    tc->entries[bin] = e->next;
+    tc->counts[bin]--;
+    return e;
+
+}
+
+// park a freed block with `usable` bytes in this thread's cache; FALSE if it does not fit
+static bool tcache_put(void* ptr, size_t usable)
+{
+
+    tcache* tc = &thread_cache;
+    unsigned limit = atomic_load_explicit(&tcache_count, memory_order_relaxed);
+    if (tc->disabled || limit == 0 || usable < ALIGNMENT || usable / ALIGNMENT > TCACHE_BINS)
+        return FALSE;
+
+    if (!tc->registered) {
+        pthread_once(&tcache_once, tcache_create_key);
+        pthread_setspecific(tcache_key, tc);
+        tc->registered = TRUE;
+    }
+
+    // a block holding `usable` bytes can serve every request of the bin below it
+    size_t bin = usable / ALIGNMENT - 1;
+    if (tc->counts[bin] >= limit)
+        tcache_flush(tc, bin, limit / 2);
+
+    tcache_entry* e = (tcache_entry*)ptr;
+    e->next = tc->entries[bin];
+    tc->entries[bin] = e;
+    tc->counts[bin]++;
+    return TRUE;
+
+}
+
+//helper function to map a block's usable size to its statistics class
+static size_t stats_class(size_t usable)
+{
+
+    // the same 16-byte classes as the thread cache, then one per power of two
+    if (usable / ALIGNMENT <= TCACHE_BINS)
+        return usable < ALIGNMENT ? 0 : usable / ALIGNMENT - 1;
+    size_t cls = TCACHE_BINS + (63 - (size_t)__builtin_clzll(usable)) - 10; // 2^10 == TCACHE_MAX_SIZE
+    return cls < STATS_CLASSES ? cls : STATS_CLASSES - 1;
+
+}
+
+//helper function to fold an exiting thread's counters into stats_retired
+static void stats_retire(void* arg)
+{
+
+    thread_stats* ts = (thread_stats*)arg;
+    pthread_mutex_lock(&stats_lock);
+    for (size_t i = 0; i < STATS_CLASSES; i++) {
+        STAT_ADD(stats_retired.alloc_count[i], atomic_load_explicit(&ts->alloc_count[i], memory_order_relaxed));
+        STAT_ADD(stats_retired.free_count[i], atomic_load_explicit(&ts->free_count[i], memory_order_relaxed));
+    }
+    STAT_ADD(stats_retired.bytes_requested, atomic_load_explicit(&ts->bytes_requested, memory_order_relaxed));
+
+    if (ts->prev) ts->prev->next = ts->next;
+    else stats_threads = ts->next;
+    if (ts->next) ts->next->prev = ts->prev;
+    pthread_mutex_unlock(&stats_lock);
+    ts->state = STATS_RETIRED; // frees from later destructors are no longer counted
+
+}
+
+static void stats_create_key(void)
+{
+    pthread_key_create(&stats_key, stats_retire);
+}
+
+//helper function to get the calling thread's counters, NULL once the thread is exiting
+static thread_stats* thread_stats_get(void)
+{
+
+    thread_stats* ts = &thread_counters;
+    if (ts->state == STATS_ACTIVE)
+        return ts;
+    if (ts->state == STATS_RETIRED)
+        return NULL;
+
+    pthread_once(&stats_once, stats_create_key);
+    pthread_mutex_lock(&stats_lock);
+    ts->prev = NULL;
+    ts->next = stats_threads;
+    if (stats_threads)
+        stats_threads->prev = ts;
+    stats_threads = ts;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, ts);
+    ts->state = STATS_ACTIVE;
+    return ts;
+
+}
+
+//helper function to count an allocation of `requested` bytes served by a block of `usable` bytes
+static void stats_alloc(size_t requested, size_t usable)
+{
+
+    if (!atomic_load_explicit(&stats_enabled, memory_order_relaxed))
+        return;
+    thread_stats* ts = thread_stats_get();
+    if (!ts) return;
+    STAT_ADD(ts->alloc_count[stats_class(usable)], 1);
+    STAT_ADD(ts->bytes_requested, requested);
+
+}
+
+//helper function to count a free of a block of `usable` bytes
+static void stats_free(size_t usable)
+{
+
+    if (!atomic_load_explicit(&stats_enabled, memory_order_relaxed))
+        return;
+    thread_stats* ts = thread_stats_get();
+    if (!ts) return;
+    STAT_ADD(ts->free_count[stats_class(usable)], 1);
+
+}
+
+//helper function to count a block resized in place from `old_usable` to `new_usable` bytes, as a free and an allocation
+static void stats_resize(size_t old_usable, size_t requested, size_t new_usable)
+{
+    stats_free(old_usable);
+    stats_alloc(requested, new_usable);
+}
+
+//helper function to read the usable size of a block from a thread cache, which is a slab object or a heap block
+static size_t cached_usable(void* ptr)
+{
+    if (in_slab(ptr))
+        return SLAB_OF(ptr)->obj_size;
+    return BLOCK_SIZE((block_header*)((char*)ptr - BLOCK_HEADER_SIZE));
+}
+
+//helper function to draw the bytes until the next sample, exponentially distributed around the interval
+static int64_t prof_next_countdown(size_t interval)
+{
+
+    // xorshift64*, seeded per thread
+    uint64_t x = prof_rng ? prof_rng : ((uint64_t)(uintptr_t)&prof_rng ^ now_ms()) | 1;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    prof_rng = x;
+    uint64_t r = ((x * 0x2545F4914F6CDD1DULL) >> 11) + 1; // uniform in [1, 2^53]
+
+    // -ln(r / 2^53) without libm: log2 is the bit position plus a quadratic fit over the mantissa
+    int msb = 63 - __builtin_clzll(r);
+    double m = (double)r / (double)((uint64_t)1 << msb) - 1.0; // [0, 1)
+    double log2_u = (double)(msb - 53) + m * (1.3465735903 - 0.3465735903 * m);
+    return (int64_t)(-log2_u * 0.6931471805599453 * (double)interval) + 1;
+
+}
+
+//helper function to carve profiler bookkeeping from its own mappings, caller holds prof_lock
+static void* prof_carve(size_t size)
+{
+
+    size = ROUND_UP(size, ALIGNMENT);
+    if ((size_t)(prof_bump_end - prof_bump) < size) {
+        char* chunk = mmap(NULL, PROF_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+            return NULL;
+        *(char**)chunk = prof_chunks;
+        prof_chunks = chunk;
+        prof_bump = chunk + ALIGNMENT;
+        prof_bump_end = chunk + PROF_CHUNK_SIZE;
+    }
+    void* p = prof_bump;
+    prof_bump += size;
+    return p;
+
+}
+
+//helper function to hash a block address into prof_live
+static size_t prof_live_bucket(const void* ptr)
+{
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 32) % PROF_LIVE_BUCKETS;
+}
+
+//helper function to find or add the entry for a call stack, caller holds prof_lock
+static prof_stack* prof_stack_get(void** frames, int depth)
+{
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++)
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) * 0x100000001b3ULL;
+
+    prof_stack** bucket = &prof_stacks[hash % PROF_STACK_BUCKETS];
+    for (prof_stack* st = *bucket; st; st = st->next)
+        if (st->hash == hash && st->depth == depth && !memcmp(st->frames, frames, depth * sizeof(void*)))
+            return st;
+
+    prof_stack* st = prof_carve(sizeof(prof_stack));
+    if (!st)
+        return NULL;
+    memset(st, 0, sizeof(*st));
+    st->hash = hash;
+    st->depth = depth;
+    memcpy(st->frames, frames, depth * sizeof(void*));
+    st->next = *bucket;
+    *bucket = st;
+    return st;
+
+}
+
+static void prof_dump_signalled(void);
+
+// record a sampled allocation; kept out of line so the frames to skip are always the same
+static __attribute__((noinline)) void prof_record(void* ptr, size_t size)
+{
+
+    void* frames[PROF_MAX_DEPTH + PROF_SKIP_FRAMES];
+    int depth = backtrace(frames, PROF_MAX_DEPTH + PROF_SKIP_FRAMES) - PROF_SKIP_FRAMES;
+    if (depth < 0)
+        depth = 0;
+
+    pthread_mutex_lock(&prof_lock);
+    if (PROF_ACTIVE()) { // profiling may have been stopped meanwhile
+        prof_stack* st = prof_stack_get(frames + PROF_SKIP_FRAMES, depth);
+        prof_sample* sm = prof_free_samples;
+        if (sm)
+            prof_free_samples = sm->next;
+        else
+            sm = prof_carve(sizeof(prof_sample));
+        if (st && sm) {
+            st->live_count++;
+            st->live_bytes += size;
+            st->total_count++;
+            st->total_bytes += size;
+            sm->ptr = ptr;
+            sm->size = size;
+            sm->stack = st;
+            size_t b = prof_live_bucket(ptr);
+            sm->next = atomic_load_explicit(&prof_live[b], memory_order_relaxed);
+            atomic_store_explicit(&prof_live[b], sm, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+}
+
+//helper function to count `size` bytes just allocated at `ptr` towards the next sample,
+//always inlined so the allocation call is the only frame between prof_record and the caller
+static inline __attribute__((always_inline)) void prof_alloc(void* ptr, size_t size)
+{
+
+    if (hook_busy || !ptr)
+        return;
+    hook_busy++;
+    if (atomic_load_explicit(&prof_dump_pending, memory_order_relaxed))
+        prof_dump_signalled();
+
+    size_t interval = atomic_load_explicit(&prof_interval, memory_order_relaxed);
+    if (prof_countdown == 0) // first allocation of this thread
+        prof_countdown = prof_next_countdown(interval);
+    prof_countdown -= (int64_t)size;
+    if (prof_countdown <= 0) {
+        prof_countdown = prof_next_countdown(interval);
+        prof_record(ptr, size);
+    }
+    hook_busy--;
+
+}
+
+//helper function to drop the sample for `ptr`, if any, before the block is freed
+static void prof_free(void* ptr)
+{
+
+    if (hook_busy || !ptr)
+        return;
+    size_t b = prof_live_bucket(ptr);
+    if (!atomic_load_explicit(&prof_live[b], memory_order_relaxed))
+        return;
+
+    pthread_mutex_lock(&prof_lock);
+    prof_sample* sm = atomic_load_explicit(&prof_live[b], memory_order_relaxed);
+    prof_sample* prev = NULL;
+    while (sm && sm->ptr != ptr) {
+        prev = sm;
+        sm = sm->next;
+    }
+    if (sm) {
+        if (prev)
+            prev->next = sm->next;
+        else
+            atomic_store_explicit(&prof_live[b], sm->next, memory_order_relaxed);
+        sm->stack->live_count--;
+        sm->stack->live_bytes -= sm->size;
+        sm->next = prof_free_samples;
+        prof_free_samples = sm;
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+}
+
+//helper function to write `len` bytes to `fd`, retrying short writes
+static bool write_all(int fd, const char* buf, size_t len)
+{
+
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return FALSE;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return TRUE;
+
+}
+
+//helper function to read the clock events are stamped with
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//helper function to write out a buffer's events, caller holds b->in_use
+static bool trace_flush(trace_buffer* b)
+{
+
+    bool ok = b->count == 0 || trace_fd == -1 || write_all(trace_fd, (const char*)b->events, b->count * sizeof(memtrace_event_t));
+    b->count = 0;
+    return ok;
+
+}
+
+// thread exit destructor: write out what is left and drop the buffer
+static void trace_buffer_release(void* arg)
+{
+
+    trace_buffer* b = (trace_buffer*)arg;
+    pthread_mutex_lock(&trace_lock);
+    trace_flush(b);
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        trace_buffers = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    pthread_mutex_unlock(&trace_lock);
+    thread_trace = NULL;
+    munmap(b, sizeof(trace_buffer));
+
+}
+
+static void trace_create_key(void)
+{
+    pthread_key_create(&trace_key, trace_buffer_release);
+}
+
+//helper function to set up the calling thread's trace buffer, mapped directly so it never recurses into the allocator
+static trace_buffer* trace_buffer_new(void)
+{
+
+    trace_buffer* b = mmap(NULL, sizeof(trace_buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+        return NULL;
+
+    pthread_once(&trace_once, trace_create_key);
+    pthread_mutex_lock(&trace_lock);
+    b->thread = ++trace_threads;
+    b->prev = NULL;
+    b->next = trace_buffers;
+    if (trace_buffers)
+        trace_buffers->prev = b;
+    trace_buffers = b;
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(trace_key, b);
+    thread_trace = b;
+    return b;
+
+}
+
+//helper function to append one event to the calling thread's buffer
+static void trace_record(uint64_t time_ns, uint32_t op, const void* object, uint64_t old_object, size_t size)
+{
+
+    trace_buffer* b = thread_trace ? thread_trace : trace_buffer_new();
+    if (!b || atomic_exchange_explicit(&b->in_use, 1, memory_order_acquire))
+        return; // memtrace_stop is flushing this buffer, so recording is over anyway
+
+    if (TRACE_ACTIVE()) {
+        memtrace_event_t* ev = &b->events[b->count++];
+        ev->time_ns = time_ns;
+        ev->object = (uint64_t)(uintptr_t)object;
+        ev->old_object = old_object;
+        ev->size = size;
+        ev->thread = b->thread;
+        ev->op = op;
+        if (b->count == TRACE_BUFFER_EVENTS)
+            trace_flush(b);
+    }
+    atomic_store_explicit(&b->in_use, 0, memory_order_release);
+
+}
+
+//helper function to show a new block to the profiler and the trace, always inlined like prof_alloc
+static inline __attribute__((always_inline)) void alloc_hook(void* ptr, size_t size, uint32_t op, uint64_t arg)
+{
+
+    if (!ptr || hook_busy)
+        return;
+    unsigned hooks = atomic_load_explicit(&alloc_hooks, memory_order_relaxed);
+    if (hooks & HOOK_TRACE)
+        trace_record(trace_now(), op, ptr, arg, size);
+    if (hooks & HOOK_PROF)
+        prof_alloc(ptr, size);
+
+}
+
+//helper function to tell the profiler and the trace about a free, before the address can be reused
+static void free_hook(void* ptr)
+{
+
+    if (!ptr || hook_busy)
+        return;
+    unsigned hooks = atomic_load_explicit(&alloc_hooks, memory_order_relaxed);
+    if (hooks & HOOK_TRACE)
+        trace_record(trace_now(), MEMTRACE_FREE, ptr, 0, 0);
+    if (hooks & HOOK_PROF)
+        prof_free(ptr);
+
+}
+
+//helper function behind memalloc and defalloc, fills `zs` (if given) with the part of the payload known to be zero
+static void* alloc_block(size_t requested_size, zero_span* zs)
+{
+    if (requested_size <= TCACHE_MAX_SIZE) {
+        void* cached = tcache_get(requested_size);
+        if (cached) {
+            // the block may be larger than its bin, and it is counted at the size it will be freed at
+            if (atomic_load_explicit(&stats_enabled, memory_order_relaxed))
+                stats_alloc(requested_size, cached_usable(cached));
+            return cached;
+        }
+    }
+
+    if (requested_size > SIZE_MAX - MIN_LEAD - OS_PAGE_SIZE)
+        return NULL; // no block header or page rounding would fit
+
+    conf_init();
+    size_t mmap_total = ROUND_UP(MMAP_HEADER_SIZE + requested_size, ALIGNMENT);
+    if (mmap_total >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) { // request mmap memory
+        void* mapped = mmap_alloc(requested_size, ALIGNMENT, zs);
+        if (mapped)
+            stats_alloc(requested_size, ((mmap_block_header*)((char*)mapped - MMAP_HEADER_SIZE))->size);
+        return mapped;
+    }
+
+    arena* a = get_thread_arena();
+    if (!a)
+        return NULL;
+
+    arena_lock(a);
+    void* user_ptr = NULL;
+    size_t usable = 0;
+    if (requested_size <= SLAB_MAX_SIZE) {
+        user_ptr = slab_alloc(a, SIZE_CLASS(requested_size), zs);
+        usable = (SIZE_CLASS(requested_size) + 1) * ALIGNMENT;
+    }
+    if (!user_ptr) { // not a slab size, or the slab region is exhausted
+        user_ptr = heap_alloc(a, requested_size, zs);
+        if (user_ptr)
+            usable = BLOCK_SIZE((block_header*)((char*)user_ptr - BLOCK_HEADER_SIZE));
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (!user_ptr) { // the arena's heap is full, the block gets a mapping of its own
+        user_ptr = mmap_alloc(requested_size, ALIGNMENT, zs);
+        if (user_ptr)
+            usable = ((mmap_block_header*)((char*)user_ptr - MMAP_HEADER_SIZE))->size;
+    }
+    if (user_ptr)
+        stats_alloc(requested_size, usable);
+    return user_ptr;
+}
+void* memalloc(size_t requested_size)
+{
+    if (requested_size == 0)
+        return NULL;
+
+    void* ptr = alloc_block(requested_size, NULL);
+    if (HOOKS_ACTIVE())
+        alloc_hook(ptr, requested_size, MEMTRACE_ALLOC, 0);
+    return ptr;
+}
+
+// carve a block from the arena's heap, caller holds a->lock
+static void* heap_alloc(arena* a, size_t requested_size, zero_span* zs)
+{
+    size_t user_payload = BLOCK_PAYLOAD(requested_size);
+    block_header* curr = find_free_block(a, user_payload);
+
+    if (curr)
+    {
+        unlink_from_free_list(a, curr);
+        curr->size &= ~(size_t)BLOCK_FREE;
+        NEXT_BLOCK(curr)->size &= ~(size_t)BLOCK_PREV_FREE;
+
+        // Split if large enough, the remainder goes back to the bins
+        split_block(a, curr, user_payload);
+
+        // a purged block reads back zero on the whole pages inside it
+        if (zs && curr->is_purged)
+            purgeable_pages(curr, &zs->from, &zs->to);
+        return (char*)curr + BLOCK_HEADER_SIZE;
+    }
+
+    // No suitable block found - carve from the top chunk, growing the heap if needed
+    if (!grow_top(a, user_payload))
+        return NULL; // the reservation is full, callers fall back to mmap
+
+    curr = a->top;
+    a->top = NULL;
+    curr->size &= ~(size_t)BLOCK_FREE;
+
+    // the remainder becomes the new top chunk
+    split_block(a, curr, user_payload);
+    char* payload = (char*)curr + BLOCK_HEADER_SIZE;
+    if (zs) {
+        zs->from = payload > a->clean_from ? payload : a->clean_from;
+        zs->to = payload + BLOCK_SIZE(curr);
+    }
+    mark_top_dirty(a);
+    return payload;
+}
+
+void* defalloc(size_t num_elements, size_t element_size)
+{
+
+    if (num_elements == 0 || element_size == 0){
+        return NULL;
+    }
+    if (num_elements > SIZE_MAX / element_size){ // overflow (too many elements)
+        return NULL;
+    }
+    size_t total_size = num_elements * element_size;
+    zero_span zs = { NULL, NULL };
+    char* ptr = alloc_block(total_size, &zs); // takes and drops the arena lock itself
+    if (!ptr) {
+        return NULL;
+    }
+
+    // clear only what may be dirty, pages that are still zero are not even touched
+    char* end = ptr + total_size;
+    if (zs.to > end)
+        zs.to = end;
+    if (zs.from >= zs.to) {
+        memoryset(ptr, 0, total_size); // nothing known, set each byte to 0
+    } else {
+        memoryset(ptr, 0, (size_t)(zs.from - ptr));
+        memoryset(zs.to, 0, (size_t)(end - zs.to));
+    }
+    if (HOOKS_ACTIVE())
+        alloc_hook(ptr, total_size, MEMTRACE_CALLOC, 0);
+    return ptr; 
+
+}
+
+void* memalloc_aligned(size_t requested_size, size_t alignment)
+{
+
+    if (requested_size == 0)
+        return NULL;
+    if (alignment == 0 || (alignment & (alignment - 1)))
+        return NULL; // not a power of two
+    if (alignment <= ALIGNMENT)
+        return memalloc(requested_size);
+    if (requested_size > SIZE_MAX - alignment - MIN_LEAD - OS_PAGE_SIZE)
+        return NULL;
+
+    conf_init();
+    size_t mmap_total = ROUND_UP(MMAP_HEADER_SIZE + requested_size + alignment, ALIGNMENT);
+    if (mmap_total >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+        void* mapped = mmap_alloc(requested_size, alignment, NULL);
+        if (mapped)
+            stats_alloc(requested_size, ((mmap_block_header*)((char*)mapped - MMAP_HEADER_SIZE))->size);
+        if (HOOKS_ACTIVE())
+            alloc_hook(mapped, requested_size, MEMTRACE_ALIGNED, alignment);
+        return mapped;
+    }
+
+    arena* a = get_thread_arena();
+    if (!a)
+        return NULL;
+
+    // over-allocate so an aligned payload fits after a leading gap big enough to be a block of its own
+    arena_lock(a);
+    char* p = heap_alloc(a, BLOCK_PAYLOAD(requested_size) + alignment + MIN_LEAD, NULL);
+    if (!p) { // the arena's heap is full
+        pthread_mutex_unlock(&a->lock);
+        void* mapped = mmap_alloc(requested_size, alignment, NULL);
+        if (mapped)
+            stats_alloc(requested_size, ((mmap_block_header*)((char*)mapped - MMAP_HEADER_SIZE))->size);
+        if (HOOKS_ACTIVE())
+            alloc_hook(mapped, requested_size, MEMTRACE_ALIGNED, alignment);
+        return mapped;
+    }
+
+    char* aligned = p;
+    if ((uintptr_t)p & (alignment - 1))
+        aligned = (char*)ROUND_UP((uintptr_t)p + MIN_LEAD, alignment);
+
+    block_header* hdr = (block_header*)(p - BLOCK_HEADER_SIZE);
+    if (aligned != p) {
+        // the gap in front becomes a free block, the rest is the aligned block
+        char* end = (char*)NEXT_BLOCK(hdr);
+        block_header* ahdr = (block_header*)(aligned - BLOCK_HEADER_SIZE);
+        ahdr->size = (size_t)(end - aligned);
+        hdr->size = (size_t)((char*)ahdr - p) | (hdr->size & BLOCK_PREV_FREE);
+        heap_free(a, hdr);
+        hdr = ahdr;
+    }
+
+    // the tail goes back through the usual split
+    split_block(a, hdr, BLOCK_PAYLOAD(requested_size));
+    size_t usable = BLOCK_SIZE(hdr);
+    pthread_mutex_unlock(&a->lock);
+    stats_alloc(requested_size, usable);
+    if (HOOKS_ACTIVE())
+        alloc_hook(aligned, requested_size, MEMTRACE_ALIGNED, alignment);
+    return aligned;
+
+}
+
+//helper function to carve `count` adjacent blocks of `payload` bytes out of one free block, caller holds a->lock
+static size_t carve_run(arena* a, size_t payload, size_t count, void** out_ptrs)
+{
+
+    size_t stride = BLOCK_HEADER_SIZE + payload;
+    if (count > (SIZE_MAX / 2) / stride)
+        return 0;
+    size_t run_payload = count * stride - BLOCK_HEADER_SIZE;
+
+    // one block big enough for the whole run, from the bins or the top chunk
+    block_header* run = find_free_block(a, run_payload);
+    if (run) {
+        unlink_from_free_list(a, run);
+        NEXT_BLOCK(run)->size &= ~(size_t)BLOCK_PREV_FREE;
+    } else if (grow_top(a, run_payload)) {
+        run = a->top;
+        a->top = NULL;
+    } else {
+        return 0;
+    }
+    run->size &= ~(size_t)BLOCK_FREE;
+    split_block(a, run, run_payload);
+
+    // a single pass writes every header, the last block keeps any slack
+    char* p = (char*)run;
+    char* end = (char*)NEXT_BLOCK(run);
+    size_t prev_free = run->size & BLOCK_PREV_FREE;
+    for (size_t i = 0; i < count; i++) {
+        block_header* h = (block_header*)p;
+        h->size = (i == count - 1) ? (size_t)(end - p) - BLOCK_HEADER_SIZE : payload;
+        if (i == 0)
+            h->size |= prev_free;
+        out_ptrs[i] = p + BLOCK_HEADER_SIZE;
+        p += stride;
+    }
+    mark_top_dirty(a);
+    return count;
+
+}
+
+//helper function to fill `out_ptrs` for memalloc_batch, returns how many blocks it got
+static size_t batch_alloc(size_t requested_size, size_t count, void** out_ptrs)
+{
+
+    size_t done = 0;
+    conf_init();
+
+    // large requests each get their own mapping, there is no lock to share
+    size_t mmap_total = ROUND_UP(MMAP_HEADER_SIZE + requested_size, ALIGNMENT);
+    if (mmap_total >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+        while (done < count && (out_ptrs[done] = mmap_alloc(requested_size, ALIGNMENT, NULL)))
+            done++;
+        return done;
+    }
+
+    // whatever the thread cache holds costs nothing
+    if (requested_size <= TCACHE_MAX_SIZE) {
+        while (done < count && (out_ptrs[done] = tcache_get(requested_size)))
+            done++;
+        if (done == count)
+            return done;
+    }
+
+    arena* a = get_thread_arena();
+    if (!a)
+        return done;
+
+    arena_lock(a);
+    if (requested_size <= SLAB_MAX_SIZE) {
+        while (done < count && (out_ptrs[done] = slab_alloc(a, SIZE_CLASS(requested_size), NULL)))
+            done++;
+    }
+    if (done < count) {
+        done += carve_run(a, BLOCK_PAYLOAD(requested_size), count - done, out_ptrs + done);
+    }
+    // no room for one run, fall back to block by block
+    while (done < count && (out_ptrs[done] = heap_alloc(a, requested_size, NULL)))
+        done++;
+    pthread_mutex_unlock(&a->lock);
+    // the arena's heap is full, the rest get mappings of their own
+    while (done < count && (out_ptrs[done] = mmap_alloc(requested_size, ALIGNMENT, NULL)))
+        done++;
+
+    return done;
+
+}
+
+size_t memalloc_batch(size_t requested_size, size_t count, void** out_ptrs)
+{
+
+    if (requested_size == 0 || count == 0 || !out_ptrs)
+        return 0;
+    if (requested_size > SIZE_MAX - MIN_LEAD - OS_PAGE_SIZE)
+        return 0; // no block header or page rounding would fit
+
+    size_t done = batch_alloc(requested_size, count, out_ptrs);
+    for (size_t i = 0; i < done; i++) {
+        stats_alloc(requested_size, memusable_size(out_ptrs[i]));
+        if (HOOKS_ACTIVE())
+            alloc_hook(out_ptrs[i], requested_size, MEMTRACE_ALLOC, 0);
+    }
+    return done;
+
+}
+
+void memfree_batch(void** ptrs, size_t count)
+{
+
+    if (!ptrs)
+        return;
+
+    // blocks skip the thread cache and go straight back, one lock per run of the same arena
+    arena* locked = NULL;
+    for (size_t i = 0; i < count; i++) {
+        void* ptr = ptrs[i];
+        if (!ptr)
+            continue;
+        if (HOOKS_ACTIVE())
+            free_hook(ptr);
+
+        arena* owner = block_owner(ptr);
+        if (!owner) {
+            mmap_block_header* mh = (mmap_block_header*)((char*)ptr - MMAP_HEADER_SIZE);
+            if (mh->is_mmap == TRUE) {
+                stats_free(mh->size);
+                mmap_free(mh);
+            }
+            continue;
+        }
+        if (owner != locked) {
+            if (locked)
+                pthread_mutex_unlock(&locked->lock);
+            arena_lock(owner);
+            locked = owner;
+        }
+        stats_free(memusable_size(ptr));
+        release_block(owner, ptr); // neighbours freed in the same batch coalesce here
+    }
+    if (locked)
+        pthread_mutex_unlock(&locked->lock);
+
+}
+
+void memfree(void* ptr)
+{
+
+    if (!ptr) return;
+    if (HOOKS_ACTIVE())
+        free_hook(ptr);
+    free_block(ptr);
+
+}
+
+//helper function behind memfree and memfree_sized
+static void free_block(void* ptr)
+{
+
+    // slab objects carry no header, their slab records the size
+    if (in_slab(ptr)) {
+        slab* sl = SLAB_OF(ptr);
+        stats_free(sl->obj_size);
+        if (tcache_put(ptr, sl->obj_size))
+            return;
+        if (sl->owner != thread_arena) {
+            remote_free(sl->owner, ptr, ptr, 1);
+            return;
+        }
+        arena_lock(sl->owner);
+        slab_free(ptr);
+        pthread_mutex_unlock(&sl->owner->lock);
+        return;
+    }
+
+    // detect mmap block safely
+    /* If ptr is outside every arena, treat it as an mmap'ed block. */
+    arena* a = arena_for_ptr(ptr);
+    if (!a) {
+        mmap_block_header* mh = (mmap_block_header*)((char*)ptr - MMAP_HEADER_SIZE);
+        if (mh->is_mmap == TRUE) {
+            stats_free(mh->size);
+            mmap_free(mh);
+        }
+        return;
+    }
+
+    // handle heap region
+    block_header* hdr = (block_header*)((char*)ptr - BLOCK_HEADER_SIZE);
+    size_t usable = BLOCK_SIZE(hdr);
+    stats_free(usable);
+
+    // small blocks go to the thread cache without touching the lock
+    if (tcache_put(ptr, usable))
+        return;
+
+    // the block goes back to the arena that owns it, another thread's arena gets it without waiting for its lock
+    if (a != thread_arena) {
+        remote_free(a, ptr, ptr, 1);
+        return;
+    }
+    arena_lock(a);
+    heap_free(a, hdr);
+    pthread_mutex_unlock(&a->lock);
+
+}
+
+void memfree_sized(void* ptr, size_t size)
+{
+
+    if (!ptr) return;
+    if (HOOKS_ACTIVE())
+        free_hook(ptr);
+
+    // only a small request can go straight to the thread cache, and only if it is a slab object or a heap block:
+    // a small block is still mmap'ed when its alignment is large or its arena's heap was full
+    bool slab_obj = in_slab(ptr);
+    if (size > 0 && size <= TCACHE_MAX_SIZE && (slab_obj || arena_for_ptr(ptr))) {
+        // the block holds at least what this size would have been given, which is all a cache bin needs,
+        // so picking the bin reads neither the slab header nor the block header
+        size_t usable = slab_obj ? ROUND_UP(size, ALIGNMENT) : BLOCK_PAYLOAD(size);
+        if (tcache_put(ptr, usable)) {
+            // statistics count the block at its real size, as they did when it was allocated, so with them
+            // on (the default) the header is read after all; `size` may be anywhere up to that real size
+            if (atomic_load_explicit(&stats_enabled, memory_order_relaxed))
+                stats_free(cached_usable(ptr));
+            return;
+        }
+    }
+
+    free_block(ptr);
+
+}
+
+size_t memusable_size(void* ptr)
+{
+
+    if (!ptr) return 0;
+
+    if (in_slab(ptr))
+        return SLAB_OF(ptr)->obj_size;
+    if (arena_for_ptr(ptr))
+        return BLOCK_SIZE((block_header*)((char*)ptr - BLOCK_HEADER_SIZE));
+    return ((mmap_block_header*)((char*)ptr - MMAP_HEADER_SIZE))->size;
+
+}
+
+// return a heap block to the free list and coalesce, caller holds a->lock
+static void heap_free(arena* a, block_header* hdr)
+{
+
+    block_header* new_hdr = hdr;
+    size_t new_payload = BLOCK_SIZE(hdr);
+
+    // the block before is free exactly when this header says so, its footer gives its size
+    if (hdr->size & BLOCK_PREV_FREE) {
+        size_t left_payload = ((block_footer*)((char*)hdr - BLOCK_FOOTER_SIZE))->size;
+        block_header* left_hdr = (block_header*)((char*)hdr - BLOCK_HEADER_SIZE - left_payload);
+        unlink_from_free_list(a, left_hdr);
+        new_payload += BLOCK_HEADER_SIZE + left_payload;
+        new_hdr = left_hdr;
+    }
+
+    // the fence at the end of the heap is never free, so the block after always exists
+    bool into_top = FALSE;
+    block_header* right_hdr = NEXT_BLOCK(hdr);
+    if (right_hdr->size & BLOCK_FREE) {
+        // the top chunk is not in any bin, it just grows downwards
+        if (right_hdr == a->top)
+            into_top = TRUE;
+        else
+            unlink_from_free_list(a, right_hdr);
+        new_payload += BLOCK_HEADER_SIZE + BLOCK_SIZE(right_hdr);
+    }
+
+    new_hdr->size = new_payload | BLOCK_FREE | (new_hdr->size & BLOCK_PREV_FREE);
+    stamp_free_block(new_hdr);
+
+    // a block reaching the end of the heap becomes the top chunk
+    if (into_top || (char*)NEXT_BLOCK(new_hdr) == a->heap_end - BLOCK_HEADER_SIZE) {
+        a->top = new_hdr;
+        if (new_payload >= atomic_load_explicit(&trim_threshold, memory_order_relaxed))
+            trim_top(a);
+    } else {
+        set_footer(new_hdr);
+        insert_into_free_list(a, new_hdr);
+    }
+
+    maybe_purge(a, new_payload >= PURGE_MIN);
+
+}
+
+/* helper function behind memresize. If `stamp` is given, a block that moves
+   stores the trace time there after the new block is obtained and before the
+   old one can be handed to another thread, so the event sorts after any free
+   of the new address and before any reuse of the old one. It is left alone
+   when the block stays put. */
+static void* resize_block(void* ptr, size_t new_size, uint64_t* stamp)
+{
+    // Case 1: null pointer allocate new block
+    if (!ptr) return memalloc(new_size);
+
+    // Case 2: requested size is 0 free block
+    if (new_size == 0) {
+        resize_stamp(stamp);
+        memfree(ptr);
+        return NULL;
+    }
+    if (new_size > SIZE_MAX - MIN_LEAD - OS_PAGE_SIZE)
+        return NULL; // no block header or page rounding would fit, the block is left as it is
+
+    // slab objects cannot grow in place, move them once they outgrow their class
+    if (in_slab(ptr)) {
+        size_t obj_size = SLAB_OF(ptr)->obj_size;
+        if (new_size <= obj_size)
+            return ptr;
+        void* new_ptr = memalloc(new_size);
+        if (!new_ptr)
+            return NULL;
+        memcpy(new_ptr, ptr, obj_size);
+        resize_stamp(stamp);
+        memfree(ptr);
+        return new_ptr;
+    }
+
+    arena* a = arena_for_ptr(ptr);
+    if (!a) // mmap'ed blocks belong to no arena
+        return mmap_resize(ptr, new_size, stamp);
+
+    arena_lock(a);
+    block_header* hdr = (block_header*)((char*)ptr - BLOCK_HEADER_SIZE);
+    size_t old_size = BLOCK_SIZE(hdr);
+    // payloads are sized like memalloc's so split remainders stay aligned
+    size_t required_size = BLOCK_PAYLOAD(new_size);
+
+    // Case 3: requested size equals current size  return ptr
+    if (required_size == old_size){
+        pthread_mutex_unlock(&a->lock);
+        return ptr;
+    }
+
+    if (required_size < old_size) {
+        // shrink current block, leftover goes back to the bins
+        split_block(a, hdr, required_size);
+        size_t usable = BLOCK_SIZE(hdr);
+        pthread_mutex_unlock(&a->lock);
+        stats_resize(old_size, new_size, usable);
+        return ptr;
+    }
+
+    // a block growing past the mmap threshold is promoted, so later growth can use mremap
+    if (ROUND_UP(MMAP_HEADER_SIZE + new_size, ALIGNMENT) >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+        pthread_mutex_unlock(&a->lock);
+        void* new_ptr = mmap_alloc(new_size, ALIGNMENT, NULL);
+        if (!new_ptr)
+            return NULL;
+        memcpy(new_ptr, ptr, old_size);
+        resize_stamp(stamp);
+        memfree(ptr);
+        stats_alloc(new_size, ((mmap_block_header*)((char*)new_ptr - MMAP_HEADER_SIZE))->size);
+        return new_ptr;
+    }
+
+    block_header* right_hdr = NEXT_BLOCK(hdr);
+
+    // the last block grows into the top chunk, and the top chunk grows the heap if it has to
+    if (right_hdr == a->top || (char*)right_hdr == a->heap_end - BLOCK_HEADER_SIZE) {
+        if (grow_top(a, required_size - old_size - BLOCK_HEADER_SIZE) && NEXT_BLOCK(hdr) == a->top) {
+            hdr->size += BLOCK_HEADER_SIZE + BLOCK_SIZE(a->top);
+            a->top = NULL;
+            split_block(a, hdr, required_size); // the rest becomes the top chunk again
+            mark_top_dirty(a);
+            size_t usable = BLOCK_SIZE(hdr);
+            pthread_mutex_unlock(&a->lock);
+            stats_resize(old_size, new_size, usable);
+            return ptr;
+        }
+    }
+
+    // otherwise free neighbours on either side are absorbed
+    size_t merged_payload = old_size;
+    bool right_free = (right_hdr->size & BLOCK_FREE) && right_hdr != a->top;
+    if (right_free)
+        merged_payload += BLOCK_HEADER_SIZE + BLOCK_SIZE(right_hdr);
+
+    // attempt in-place expansion by merging with right free block
+    if (right_free && merged_payload >= required_size) {
+        // unlink right block from free list
+        unlink_from_free_list(a, right_hdr);
+
+        // expand current block
+        hdr->size = merged_payload | (hdr->size & BLOCK_PREV_FREE);
+        NEXT_BLOCK(hdr)->size &= ~(size_t)BLOCK_PREV_FREE;
+
+        // split leftover if any
+        split_block(a, hdr, required_size);
+        size_t usable = BLOCK_SIZE(hdr);
+        pthread_mutex_unlock(&a->lock);
+        stats_resize(old_size, new_size, usable);
+        return ptr;
+    }
+
+    // a free left neighbour works too, the contents slide down to its start
+    if (hdr->size & BLOCK_PREV_FREE) {
+        size_t left_payload = ((block_footer*)((char*)hdr - BLOCK_FOOTER_SIZE))->size;
+        if (merged_payload + BLOCK_HEADER_SIZE + left_payload >= required_size) {
+            block_header* left_hdr = (block_header*)((char*)hdr - BLOCK_HEADER_SIZE - left_payload);
+            unlink_from_free_list(a, left_hdr);
+            if (right_free)
+                unlink_from_free_list(a, right_hdr);
+
+            left_hdr->size = (merged_payload + BLOCK_HEADER_SIZE + left_payload) | (left_hdr->size & BLOCK_PREV_FREE);
+            NEXT_BLOCK(left_hdr)->size &= ~(size_t)BLOCK_PREV_FREE;
+            void* new_ptr = (char*)left_hdr + BLOCK_HEADER_SIZE;
+            memmove(new_ptr, ptr, old_size);
+
+            split_block(a, left_hdr, required_size);
+            size_t usable = BLOCK_SIZE(left_hdr);
+            pthread_mutex_unlock(&a->lock);
+            stats_resize(old_size, new_size, usable);
+            return new_ptr;
+        }
+    }
+
+    // move within the same arena without letting go of the lock in between
+    void* new_ptr = heap_alloc(a, new_size, NULL);
+    if (!new_ptr) { // the arena's heap is full, the block moves to a mapping of its own
+        pthread_mutex_unlock(&a->lock);
+        new_ptr = mmap_alloc(new_size, ALIGNMENT, NULL);
+        if (!new_ptr)
+            return NULL;
+        memcpy(new_ptr, ptr, old_size);
+        resize_stamp(stamp);
+        memfree(ptr);
+        stats_alloc(new_size, ((mmap_block_header*)((char*)new_ptr - MMAP_HEADER_SIZE))->size);
+        return new_ptr;
+    }
+    memcpy(new_ptr, ptr, old_size);
+    resize_stamp(stamp); // nobody can reuse the old block before the lock is let go
+    heap_free(a, hdr);
+    size_t usable = BLOCK_SIZE((block_header*)((char*)new_ptr - BLOCK_HEADER_SIZE));
+    pthread_mutex_unlock(&a->lock);
+
+    stats_resize(old_size, new_size, usable);
+    return new_ptr;
+
+}
+
+void* memresize(void* ptr, size_t new_size)
+{
+
+    if (!HOOKS_ACTIVE() || hook_busy)
+        return resize_block(ptr, new_size, NULL);
+
+    // the old block leaves the profile before its address can be reused;
+    // if the resize fails, the block stays allocated but is no longer in the profile
+    unsigned hooks = atomic_load_explicit(&alloc_hooks, memory_order_relaxed);
+    if (hooks & HOOK_PROF)
+        prof_free(ptr);
+    uint64_t stamp = 0;
+    hook_busy++;
+    void* new_ptr = resize_block(ptr, new_size, hooks & HOOK_TRACE ? &stamp : NULL);
+    hook_busy--;
+    // a block that moved was stamped between its two addresses, one that stayed put is stamped now, like an allocation
+    if ((hooks & HOOK_TRACE) && (new_ptr || new_size == 0))
+        trace_record(stamp ? stamp : trace_now(), MEMTRACE_RESIZE, new_ptr, (uint64_t)(uintptr_t)ptr, new_size);
+    if (hooks & HOOK_PROF)
+        prof_alloc(new_ptr, new_size);
+    return new_ptr;
+
+}
+
+size_t memtrim(void)
+{
+
+    size_t released = 0;
+
+    // cut every top chunk back and purge all large free blocks, however recently freed
+    size_t n = atomic_load(&arena_count);
+    for (size_t i = 0; i < n; i++) {
+        arena* a = &arenas[i];
+        arena_lock(a);
+        if (a->top)
+            released += trim_top(a);
+        released += purge_arena(a, (uint32_t)now_ms(), TRUE);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    // cached mappings are only kept for speed
+    pthread_mutex_lock(&mmap_cache_lock);
+    released += mmap_cache_expire(0, TRUE);
+    pthread_mutex_unlock(&mmap_cache_lock);
+
+    return released;
+
+}
+
+//helper function to add an arena's heap to the statistics, caller holds a->lock
+static void stats_walk_heap(arena* a, memstats_t* out)
+{
+
+    out->heap_size += (size_t)(a->heap_end - a->heap_start);
+    if (a->heap_end == a->heap_start)
+        return;
+    char* p = a->heap_start + BLOCK_HEADER_SIZE;
+    while (p < a->heap_end - BLOCK_HEADER_SIZE) {
+        block_header* h = (block_header*)p;
+        size_t size = BLOCK_SIZE(h);
+        if (h->size & BLOCK_FREE) {
+            out->heap_free += size;
+            if (h != a->top)
+                out->free_blocks++;
+            if (size > out->largest_free_block)
+                out->largest_free_block = size;
+        } else {
+            out->bytes_in_use += size;
+        }
+        p += BLOCK_HEADER_SIZE + size;
+    }
+    out->lock_acquired += a->lock_acquired;
+    out->lock_contended += a->lock_contended;
+
+}
+
+//helper function to add one thread's counters to the statistics, caller holds stats_lock
+static void stats_sum_counters(thread_stats* ts, memstats_t* out)
+{
+
+    for (size_t c = 0; c < STATS_CLASSES; c++) {
+        out->alloc_count[c] += atomic_load_explicit(&ts->alloc_count[c], memory_order_relaxed);
+        out->free_count[c] += atomic_load_explicit(&ts->free_count[c], memory_order_relaxed);
+    }
+    out->bytes_requested += atomic_load_explicit(&ts->bytes_requested, memory_order_relaxed);
+
+}
+
+void memstats(memstats_t* out)
+{
+
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+
+    // every arena lock is held so slabs, whose owners may be any arena, can be read too
+    size_t n = atomic_load(&arena_count);
+    for (size_t i = 0; i < n; i++)
+        arena_lock(&arenas[i]);
+    for (size_t i = 0; i < n; i++)
+        stats_walk_heap(&arenas[i], out);
+
+    pthread_mutex_lock(&slab_lock);
+    if (slab_region_start) {
+        out->slab_bytes = (size_t)(slab_region_next - slab_region_start);
+        for (char* p = slab_region_start; p < slab_region_next; p += SLAB_SIZE) {
+            slab* sl = (slab*)p;
+            out->bytes_in_use += (size_t)sl->used * sl->obj_size;
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+
+    for (size_t i = n; i > 0; i--)
+        pthread_mutex_unlock(&arenas[i - 1].lock);
+
+    out->arenas = n;
+    out->heap_peak = atomic_load_explicit(&heap_peak, memory_order_relaxed);
+    out->mmap_count = atomic_load_explicit(&mmap_live_count, memory_order_relaxed);
+    out->mmap_bytes = atomic_load_explicit(&mmap_live_bytes, memory_order_relaxed);
+    pthread_mutex_lock(&mmap_cache_lock);
+    out->mmap_cached_bytes = mmap_cached_bytes;
+    pthread_mutex_unlock(&mmap_cache_lock);
+
+    out->bytes_in_use += out->mmap_bytes;
+    out->bytes_mapped = out->heap_size + out->slab_bytes + out->mmap_bytes + out->mmap_cached_bytes;
+    out->fragmentation = out->heap_free ? 1.0 - (double)out->largest_free_block / (double)out->heap_free : 0.0;
+
+    // live threads plus everything threads counted before they exited
+    pthread_mutex_lock(&stats_lock);
+    stats_sum_counters(&stats_retired, out);
+    for (thread_stats* ts = stats_threads; ts; ts = ts->next)
+        stats_sum_counters(ts, out);
+    pthread_mutex_unlock(&stats_lock);
+
+}
+
+//helper function to append formatted text at buf + *pos, tracking the full length like snprintf
+static void dump_append(char* buf, size_t len, size_t* pos, const char* fmt, ...)
+{
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(*pos < len ? buf + *pos : NULL, *pos < len ? len - *pos : 0, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *pos += (size_t)n;
+
+}
+
+//helper function to give the smallest usable size of a statistics class
+static size_t stats_class_min(size_t cls)
+{
+    if (cls < TCACHE_BINS)
+        return (cls + 1) * ALIGNMENT;
+    return cls == TCACHE_BINS ? TCACHE_MAX_SIZE + ALIGNMENT : (size_t)1 << (cls - TCACHE_BINS + 10);
+}
+
+size_t memstats_dump(char* buf, size_t len, int json)
+{
+
+    memstats_t st;
+    memstats(&st);
+
+    static const char* names[] = {
+        "bytes_requested", "bytes_in_use", "bytes_mapped", "heap_size", "heap_peak", "heap_free",
+        "free_blocks", "largest_free_block", "slab_bytes", "mmap_count", "mmap_bytes",
+        "mmap_cached_bytes", "arenas", "lock_acquired", "lock_contended"
+    };
+    size_t values[] = {
+        st.bytes_requested, st.bytes_in_use, st.bytes_mapped, st.heap_size, st.heap_peak, st.heap_free,
+        st.free_blocks, st.largest_free_block, st.slab_bytes, st.mmap_count, st.mmap_bytes,
+        st.mmap_cached_bytes, st.arenas, st.lock_acquired, st.lock_contended
+    };
+
+    size_t pos = 0;
+    if (buf && len) buf[0] = '\0';
+    dump_append(buf, len, &pos, json ? "{" : "");
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        dump_append(buf, len, &pos, json ? "\"%s\":%zu," : "%-20s %zu\n", names[i], values[i]);
+    dump_append(buf, len, &pos, json ? "\"%s\":%.4f," : "%-20s %.4f\n", "fragmentation", st.fragmentation);
+    dump_append(buf, len, &pos, json ? "\"classes\":[" : "%-20s %12s %12s\n", "class_min_size", "allocs", "frees");
+
+    bool first = TRUE;
+    for (size_t c = 0; c < STATS_CLASSES; c++) {
+        if (!st.alloc_count[c] && !st.free_count[c])
+            continue;
+        dump_append(buf, len, &pos, json ? "%s{\"min_size\":%zu,\"allocs\":%zu,\"frees\":%zu}" : "%s%-20zu %12zu %12zu\n",
+                    json && !first ? "," : "", stats_class_min(c), st.alloc_count[c], st.free_count[c]);
+        first = FALSE;
+    }
+    dump_append(buf, len, &pos, json ? "]}\n" : "");
+    return pos;
+
+}
+
+void memprof_start(size_t sample_interval)
+{
+
+    // backtrace() loads its unwinder on first use, which allocates, so that happens here and not mid-sample
+    void* frame;
+    hook_busy++;
+    backtrace(&frame, 1);
+    hook_busy--;
+    atomic_store(&prof_interval, sample_interval ? sample_interval : PROF_DEFAULT_INTERVAL);
+    atomic_fetch_or(&alloc_hooks, HOOK_PROF);
+
+}
+
+void memprof_stop(void)
+{
+
+    atomic_fetch_and(&alloc_hooks, ~(unsigned)HOOK_PROF);
+    pthread_mutex_lock(&prof_lock);
+    memset(prof_stacks, 0, sizeof(prof_stacks));
+    for (size_t i = 0; i < PROF_LIVE_BUCKETS; i++)
+        atomic_store_explicit(&prof_live[i], NULL, memory_order_relaxed);
+    prof_free_samples = NULL;
+    while (prof_chunks) {
+        char* next = *(char**)prof_chunks;
+        munmap(prof_chunks, PROF_CHUNK_SIZE);
+        prof_chunks = next;
+    }
+    prof_bump = prof_bump_end = NULL;
+    pthread_mutex_unlock(&prof_lock);
+
+}
+
+int memprof_dump(const char* path)
+{
+
+    int fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : STDERR_FILENO;
+    if (fd == -1) {
+        perror("open heap profile");
+        return -1;
+    }
+
+    char line[128 + PROF_MAX_DEPTH * 20];
+    size_t pos = 0;
+    bool ok = TRUE;
+    pthread_mutex_lock(&prof_lock);
+
+    // gperftools' heap profile format, which pprof reads: live objects and bytes, then all-time ones
+    size_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+    for (size_t i = 0; i < PROF_STACK_BUCKETS; i++)
+        for (prof_stack* st = prof_stacks[i]; st; st = st->next) {
+            live_count += st->live_count;
+            live_bytes += st->live_bytes;
+            total_count += st->total_count;
+            total_bytes += st->total_bytes;
+        }
+    dump_append(line, sizeof(line), &pos, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                live_count, live_bytes, total_count, total_bytes, atomic_load(&prof_interval));
+    ok = write_all(fd, line, pos);
+
+    for (size_t i = 0; ok && i < PROF_STACK_BUCKETS; i++)
+        for (prof_stack* st = prof_stacks[i]; ok && st; st = st->next) {
+            pos = 0;
+            dump_append(line, sizeof(line), &pos, "%zu: %zu [%zu: %zu] @",
+                        st->live_count, st->live_bytes, st->total_count, st->total_bytes);
+            for (int f = 0; f < st->depth; f++)
+                dump_append(line, sizeof(line), &pos, " %p", st->frames[f]);
+            dump_append(line, sizeof(line), &pos, "\n");
+            ok = write_all(fd, line, pos < sizeof(line) ? pos : sizeof(line) - 1);
+        }
+    pthread_mutex_unlock(&prof_lock);
+
+    // the memory map lets pprof turn addresses into symbols
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (ok && maps != -1) {
+        static const char maps_header[] = "\nMAPPED_LIBRARIES:\n";
+        ok = write_all(fd, maps_header, sizeof(maps_header) - 1);
+        ssize_t n;
+        while (ok && (n = read(maps, line, sizeof(line))) > 0)
+            ok = write_all(fd, line, (size_t)n);
+    }
+    if (maps != -1)
+        close(maps);
+    if (path)
+        close(fd);
+    return ok ? 0 : -1;
+
+}
+
+//helper function to write the profile a signal asked for, from an ordinary allocation
+static void prof_dump_signalled(void)
+{
+    if (atomic_exchange(&prof_dump_pending, 0))
+        memprof_dump(prof_signal_path[0] ? prof_signal_path : NULL);
+}
+
+// signal handler: only flags the request, writing the profile is not async-signal-safe
+static void prof_signal_handler(int signo)
+{
+    (void)signo;
+    atomic_store(&prof_dump_pending, 1);
+}
+
+int memprof_dump_on_signal(int signo, const char* path)
+{
+
+    if (path && strlen(path) >= PROF_PATH_MAX)
+        return -1;
+    strcpy(prof_signal_path, path ? path : "");
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signo, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+
+}
+
+int memtrace_start(const char* path)
+{
+
+    if (!path)
+        return -1;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd != -1) { // already recording
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open trace");
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    uint32_t header[2] = { MEMTRACE_MAGIC, MEMTRACE_VERSION };
+    if (!write_all(fd, (const char*)header, sizeof(header))) {
+        close(fd);
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    trace_fd = fd;
+    atomic_fetch_or(&alloc_hooks, HOOK_TRACE);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+
+}
+
+int memtrace_stop(void)
+{
+
+    atomic_fetch_and(&alloc_hooks, ~(unsigned)HOOK_TRACE);
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd == -1) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    // every thread's buffer is written out, waiting for an owner that is appending right now
+    bool ok = TRUE;
+    for (trace_buffer* b = trace_buffers; b; b = b->next) {
+        while (atomic_exchange_explicit(&b->in_use, 1, memory_order_acquire))
+            sched_yield();
+        ok = trace_flush(b) && ok;
+        atomic_store_explicit(&b->in_use, 0, memory_order_release);
+    }
+    if (close(trace_fd) == -1)
+        ok = FALSE;
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+    return ok ? 0 : -1;
+
+}
+
+//helper function to check a tuning value and put it in place, -1 if it is out of range
+static int conf_set(int param, size_t value)
+{
+
+    switch (param) {
+    case MEMALLOPT_GROW_SIZE:
+        // heap growth rounds up to the step with ROUND_UP, so it must be a power of two
+        if (value < OS_PAGE_SIZE || value > GROW_SIZE_MAX || (value & (value - 1)))
+            return -1;
+        atomic_store_explicit(&grow_size, value, memory_order_relaxed);
+        return 0;
+    case MEMALLOPT_MMAP_THRESHOLD:
+        if (value < OS_PAGE_SIZE || value > MMAP_THRESHOLD_LIMIT)
+            return -1;
+        atomic_store_explicit(&mmap_threshold_fixed, TRUE, memory_order_relaxed);
+        atomic_store_explicit(&mmap_threshold, value, memory_order_relaxed);
+        return 0;
+    case MEMALLOPT_TCACHE_COUNT:
+        if (value > TCACHE_COUNT_MAX)
+            return -1;
+        atomic_store_explicit(&tcache_count, (unsigned)value, memory_order_relaxed);
+        return 0;
+    case MEMALLOPT_MMAP_CACHE_BYTES:
+        if (value > MMAP_CACHE_BYTES_LIMIT)
+            return -1;
+        pthread_mutex_lock(&mmap_cache_lock);
+        mmap_cache_max = value;
+        if (mmap_cached_bytes > value)
+            mmap_cache_expire(0, TRUE);
+        pthread_mutex_unlock(&mmap_cache_lock);
+        return 0;
+    case MEMALLOPT_PURGE_DECAY_MS:
+        if (value > PURGE_DECAY_MAX_MS)
+            return -1;
+        atomic_store_explicit(&purge_decay_ms, (unsigned)value, memory_order_relaxed);
+        return 0;
+    case MEMALLOPT_FIT:
+        if (value > PLACEMENT_ADDRESS)
+            return -1;
+        atomic_store_explicit(&placement_policy, (int)value, memory_order_relaxed);
+        return 0;
+    case MEMALLOPT_STATS:
+        if (value > 1)
+            return -1;
+        atomic_store_explicit(&stats_enabled, value == 1, memory_order_relaxed);
+        return 0;
+    }
+    return -1;
+
+}
+
+// MEMALLOC_CONF option names, indexed by MEMALLOPT_* parameter
+static const char* const conf_names[] = {
+    NULL, "grow_size", "mmap_threshold", "tcache_count", "mmap_cache_bytes", "purge_decay_ms", "fit", "stats"
+};
+
+// names accepted for fit, indexed by MEMALLOPT_FIT_* value
+static const char* const fit_names[] = { "lifo", "fifo", "address" };
+
+//helper function to tell whether the `len` bytes at `s` spell `name`
+static bool conf_match(const char* s, size_t len, const char* name)
+{
+    return strlen(name) == len && memcmp(s, name, len) == 0;
+}
+
+//helper function to parse a decimal number with an optional k, m or g suffix, FALSE if it is not one
+static bool conf_number(const char* s, size_t len, size_t* out)
+{
+
+    size_t value = 0;
+    size_t i = 0;
+    for (; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+        if (value > (SIZE_MAX - 9) / 10)
+            return FALSE;
+        value = value * 10 + (size_t)(s[i] - '0');
+    }
+    if (i == 0)
+        return FALSE;
+
+    if (i + 1 == len) {
+        unsigned shift;
+        switch (s[i]) {
+        case 'k': case 'K': shift = 10; break;
+        case 'm': case 'M': shift = 20; break;
+        case 'g': case 'G': shift = 30; break;
+        default: return FALSE;
+        }
+        if (value > SIZE_MAX >> shift)
+            return FALSE;
+        value <<= shift;
+    } else if (i != len) {
+        return FALSE;
+    }
+    *out = value;
+    return TRUE;
+
+}
+
+//helper function to apply one name:value option of MEMALLOC_CONF, FALSE if it is not a valid one
+static bool conf_apply(const char* opt, size_t len)
+{
+
+    const char* colon = memchr(opt, ':', len);
+    if (!colon)
+        return FALSE;
+    size_t name_len = (size_t)(colon - opt);
+    const char* val = colon + 1;
+    size_t val_len = len - name_len - 1;
+
+    for (int param = 1; param < (int)(sizeof(conf_names) / sizeof(conf_names[0])); param++) {
+        if (!conf_match(opt, name_len, conf_names[param]))
+            continue;
+        size_t value = SIZE_MAX;
+        if (param == MEMALLOPT_FIT) {
+            for (size_t i = 0; i < sizeof(fit_names) / sizeof(fit_names[0]); i++)
+                if (conf_match(val, val_len, fit_names[i]))
+                    value = i;
+        }
+        if (value == SIZE_MAX && !conf_number(val, val_len, &value))
+            return FALSE;
+        return conf_set(param, value) == 0;
+    }
+    return FALSE;
+
+}
+
+//helper function to read MEMALLOC_CONF, warning about and skipping options that are not valid
+static void conf_load(void)
+{
+
+    // runs inside the first allocation, so the string is walked in place and the warning written directly
+    const char* conf = getenv("MEMALLOC_CONF");
+    static const char warning[] = "memalloc: ignoring MEMALLOC_CONF option \"";
+    while (conf && *conf) {
+        size_t len = strcspn(conf, ",");
+        if (len && !conf_apply(conf, len)) {
+            write_all(STDERR_FILENO, warning, sizeof(warning) - 1);
+            write_all(STDERR_FILENO, conf, len);
+            write_all(STDERR_FILENO, "\"\n", 2);
+        }
+        conf += len;
+        if (*conf == ',')
+            conf++;
+    }
+    atomic_store_explicit(&conf_loaded, TRUE, memory_order_release);
+
+}
+
+//helper function to apply MEMALLOC_CONF the first time through
+static void conf_init(void)
+{
+    if (!atomic_load_explicit(&conf_loaded, memory_order_acquire))
+        pthread_once(&conf_once, conf_load);
+}
+
+int memallopt(int param, size_t value)
+{
+
+    // the environment is read first, so it never overrides a value set here
+    conf_init();
+    return conf_set(param, value);
+
+}
+
+int memallopt_get(int param, size_t* value)
+{
+
+    conf_init();
+    size_t v;
+    switch (param) {
+    case MEMALLOPT_GROW_SIZE: v = atomic_load_explicit(&grow_size, memory_order_relaxed); break;
+    case MEMALLOPT_MMAP_THRESHOLD: v = atomic_load_explicit(&mmap_threshold, memory_order_relaxed); break;
+    case MEMALLOPT_TCACHE_COUNT: v = atomic_load_explicit(&tcache_count, memory_order_relaxed); break;
+    case MEMALLOPT_MMAP_CACHE_BYTES:
+        pthread_mutex_lock(&mmap_cache_lock);
+        v = mmap_cache_max;
+        pthread_mutex_unlock(&mmap_cache_lock);
+        break;
+    case MEMALLOPT_PURGE_DECAY_MS: v = atomic_load_explicit(&purge_decay_ms, memory_order_relaxed); break;
+    case MEMALLOPT_FIT: v = (size_t)atomic_load_explicit(&placement_policy, memory_order_relaxed); break;
+    case MEMALLOPT_STATS: v = atomic_load_explicit(&stats_enabled, memory_order_relaxed); break;
+    default: return -1;
+    }
+    if (value)
+        *value = v;
+    return 0;
+
+}
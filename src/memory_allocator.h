@@ -2,6 +2,87 @@
 #define MEMORY_ALLOCATOR_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+/* Size classes used by memstats(): classes 0..63 hold blocks of 16*(c+1) to
+   16*(c+2)-1 usable bytes, the rest one power of two each, the last one open-ended. */
+#define MEMSTATS_CLASSES 104
+
+typedef struct memstats_t {
+    size_t bytes_requested;             // sum of all sizes ever passed to the allocation calls
+    size_t bytes_in_use;                // usable bytes of live blocks, including blocks parked in thread caches
+    size_t bytes_mapped;                // memory committed from the OS: heaps, slabs, mappings and the mapping cache
+    size_t heap_size;                   // sum of heap_end - heap_start over all arenas
+    size_t heap_peak;                   // highest heap_size so far
+    size_t heap_free;                   // free heap bytes, top chunks included
+    size_t free_blocks;                 // blocks on the free lists
+    size_t largest_free_block;          // largest free payload, top chunks included
+    double fragmentation;               // 1 - largest_free_block / heap_free, 0 when nothing is free
+    size_t slab_bytes;                  // slab memory committed
+    size_t mmap_count;                  // live mmap'ed blocks
+    size_t mmap_bytes;                  // bytes mapped for them
+    size_t mmap_cached_bytes;           // freed mappings kept for reuse
+    size_t arenas;
+    size_t lock_acquired;               // arena lock acquisitions
+    size_t lock_contended;              // acquisitions that had to wait
+    size_t alloc_count[MEMSTATS_CLASSES];
+    size_t free_count[MEMSTATS_CLASSES];
+} memstats_t;
+
+/* A trace written by memtrace_start() is the 8-byte header { MEMTRACE_MAGIC,
+   MEMTRACE_VERSION } followed by memtrace_event_t records, in blocks of one
+   thread's events each. Sorting the records by time_ns gives the order the
+   calls happened in: allocations are stamped after they return, frees
+   before the block is released, and a resize that moves its block in between
+   the two, so a reused address is never seen in use twice. bench/replay.c
+   plays a trace back. */
+#define MEMTRACE_MAGIC 0x4352544d       // "MTRC" in a little-endian file
+#define MEMTRACE_VERSION 1
+#define MEMTRACE_ALLOC 1                // memalloc, memalloc_batch
+#define MEMTRACE_CALLOC 2               // defalloc, size is the total
+#define MEMTRACE_ALIGNED 3              // memalloc_aligned, old_object is the alignment
+#define MEMTRACE_RESIZE 4               // memresize, old_object is the block passed in (0 for NULL)
+#define MEMTRACE_FREE 5                 // memfree, memfree_sized, memfree_batch
+
+typedef struct memtrace_event_t {
+    uint64_t time_ns;                   // CLOCK_MONOTONIC
+    uint64_t object;                    // address returned, or freed
+    uint64_t old_object;
+    uint64_t size;                      // bytes requested
+    uint32_t thread;                    // small id per recording thread
+    uint32_t op;                        // MEMTRACE_*
+} memtrace_event_t;
+
+/* Parameters for memallopt() and memallopt_get(). The same settings can be
+   given in the MEMALLOC_CONF environment variable, read when the allocator is
+   first used, as comma-separated name:value pairs with an optional k, m or g
+   suffix, e.g. MEMALLOC_CONF=mmap_threshold:1m,tcache_count:64,fit:address */
+#define MEMALLOPT_GROW_SIZE 1           // grow_size: smallest heap growth step, a power of two from 4 KiB to 64 MiB (16 KiB)
+#define MEMALLOPT_MMAP_THRESHOLD 2      // mmap_threshold: requests this big are mmap'ed, 4 KiB to 32 MiB (128 KiB, adapts until set)
+#define MEMALLOPT_TCACHE_COUNT 3        // tcache_count: blocks a thread caches per size class, up to 4096, 0 disables (32)
+#define MEMALLOPT_MMAP_CACHE_BYTES 4    // mmap_cache_bytes: freed mappings kept for reuse, up to 1 GiB, 0 disables (64 MiB)
+#define MEMALLOPT_PURGE_DECAY_MS 5      // purge_decay_ms: how long a large free block stays resident, up to a day (5000)
+#define MEMALLOPT_FIT 6                 // fit: where freed blocks go in their bin, MEMALLOPT_FIT_* or lifo/fifo/address
+#define MEMALLOPT_STATS 7               // stats: 1 counts allocations and frees for memstats, 0 stops counting (1)
+
+#define MEMALLOPT_FIT_LIFO 0            // the most recently freed block is reused first
+#define MEMALLOPT_FIT_FIFO 1            // the oldest free block is reused first
+#define MEMALLOPT_FIT_ADDRESS 2         // the lowest free block is reused first
+
+/* A region bump-allocates from chunks it owns (see memregion_create). A mark
+   records how far a region had got, to be handed back to memregion_release. */
+typedef struct memregion_t memregion_t;
+
+typedef struct memregion_mark_t {
+    void* chunk;                        // chunk being filled when the mark was taken
+    char* pos;                          // next free byte in it
+    void* large;                        // newest oversized block at the time
+} memregion_mark_t;
+
+/* An object pool hands out objects of a single size (see mempool_create). */
+typedef struct mempool_t mempool_t;
+
+#define MEMPOOL_THREAD_CACHE 0x1        // keep a few free objects per thread, get/put skip the pool lock
 
 /**
  * @brief Allocates memory of a given size.
@@ -30,6 +111,10 @@ void* memalloc(size_t requested_size);
  * zeroing all bytes in the allocated memory. It is useful for initializing arrays
  * of structs or primitive types without manually setting each element to zero.
  *
+ * Only bytes that may be dirty are cleared. Memory fresh from the kernel (a new
+ * mapping, never-used heap pages, purged pages) is already zero and is not touched,
+ * so a large zeroed table costs no page faults until it is written.
+ *
  * If allocation fails, NULL is returned. The caller must free the memory using
  * `memfree()` when done.
  *
@@ -46,7 +131,8 @@ void* defalloc(size_t num_elements, size_t element_size);
  * This function returns the memory pointed to by `ptr` to the allocator's free
  * list and if the memory was mapped using `mmap()`, it is returned to the OS.
  * The memory can then be reused for future allocations. Passing NULL has
- * no effect.
+ * no effect. Small blocks are first parked in the calling thread's cache and
+ * only reach the shared free list when that cache overflows or the thread exits.
  *
  * @param ptr Pointer to memory to free. Can be NULL (no operation).
  * @return void
@@ -73,5 +159,348 @@ void memfree(void* ptr);
  */
 void* memresize(void* ptr, size_t new_size);
 
-#endif // MEMORY_ALLOCATOR_H
+/**
+ * @brief Allocates memory whose address is a multiple of `alignment`.
+ *
+ * Works like `memalloc()` but aligns the returned pointer to `alignment`
+ * bytes, e.g. 64 for a cache line or 4096 for a page. On the heap the padding
+ * in front of the block is returned to the free list, so little memory is
+ * wasted. Large requests get their own mapping with the payload aligned inside it.
+ *
+ * The pointer can be passed to `memfree()` and `memresize()` like any other.
+ * A block moved by `memresize()` is only guaranteed 16-byte alignment.
+ *
+ * @param requested_size Number of bytes to allocate.
+ * @param alignment Required alignment, any power of two. Alignments above 1 GiB
+ *        always get a mapping of their own.
+ * @return void* Pointer to aligned memory, or NULL if allocation fails or the
+ *         alignment is invalid.
+ * @note It is thread-safe.
+ */
+void* memalloc_aligned(size_t requested_size, size_t alignment);
+
+/**
+ * @brief Allocates `count` blocks of the same size in one call.
+ *
+ * Fills `out_ptrs` with pointers to `count` blocks of `requested_size` bytes,
+ * each of which can later be freed on its own with `memfree()` or together with
+ * `memfree_batch()`. The lock is taken once, and heap blocks are carved
+ * side by side out of a single free block, so a batch costs about as much as
+ * one allocation.
+ *
+ * @param requested_size Size of each block in bytes.
+ * @param count Number of blocks to allocate.
+ * @param out_ptrs Array of at least `count` entries receiving the pointers.
+ * @return size_t Number of blocks allocated. Less than `count` only when memory runs out.
+ * @note It is thread-safe.
+ */
+size_t memalloc_batch(size_t requested_size, size_t count, void** out_ptrs);
+
+/**
+ * @brief Frees `count` blocks in one call.
+ *
+ * Equivalent to calling `memfree()` on every pointer in `ptrs`, but the blocks
+ * bypass the thread cache and each arena's lock is taken once per run of
+ * pointers belonging to it. Neighbouring blocks from the same batch are
+ * coalesced as they go back. NULL entries are skipped.
+ *
+ * @param ptrs Array of pointers to free.
+ * @param count Number of entries in `ptrs`.
+ * @return void
+ * @note It is thread-safe.
+ */
+void memfree_batch(void** ptrs, size_t count);
+
+/**
+ * @brief Frees memory whose size the caller already knows.
+ *
+ * Same as `memfree()`, but `size` is used to pick where the block goes, so
+ * small blocks reach the thread cache without reading any header, except the
+ * one read to count the free while statistics are enabled. `size` must
+ * be between the size last passed to `memalloc()`, `defalloc()` (total bytes),
+ * `memresize()`, `memalloc_batch()` or `memalloc_aligned()` and
+ * `memusable_size(ptr)`. A block with a mapping of its own is recognised by its
+ * address and freed like `memfree()` would, whatever `size` says.
+ *
+ * @param ptr Pointer to memory to free. Can be NULL (no operation).
+ * @param size Size of the block as described above.
+ * @return void
+ * @note Passing a size larger than the block is undefined behaviour.
+ */
+void memfree_sized(void* ptr, size_t size);
+
+/**
+ * @brief Returns how many bytes the block at `ptr` can actually hold.
+ *
+ * Requests are rounded up to a size class, a 16-byte step or whole pages, so
+ * a block is often larger than what was asked for. All of it belongs to the
+ * caller: a growing buffer can use the slack before calling `memresize()`.
+ *
+ * @param ptr Pointer returned by this allocator. Can be NULL (returns 0).
+ * @return size_t Usable size in bytes, at least the requested size.
+ * @note It is thread-safe.
+ */
+size_t memusable_size(void* ptr);
+
+/**
+ * @brief Takes a snapshot of the allocator's statistics.
+ *
+ * Allocation and free counts are kept per thread and summed here, so counting
+ * costs almost nothing on the allocation path. The heap figures come from
+ * walking every arena, which briefly holds all arena locks, so this is meant
+ * for periodic sampling rather than hot paths. Frees are counted by memfree
+ * and friends; a block parked in a thread cache is still counted as in use.
+ *
+ * @param out Structure to fill.
+ * @return void
+ * @note It is thread-safe.
+ */
+void memstats(memstats_t* out);
+
+/**
+ * @brief Formats the current statistics as text or JSON.
+ *
+ * Writes at most `len` bytes, including the terminating NUL, to `buf`, like
+ * `snprintf()`. Size classes that saw no traffic are left out. The JSON form
+ * is a single object, meant for feeding a metrics exporter.
+ *
+ * @param buf Destination buffer. Can be NULL when `len` is 0.
+ * @param len Size of `buf`.
+ * @param json Non-zero for JSON, zero for human-readable text.
+ * @return size_t Length of the full output, excluding the NUL. If it is
+ *         `len` or more, the output was truncated.
+ * @note It is thread-safe.
+ */
+size_t memstats_dump(char* buf, size_t len, int json);
+
+/**
+ * @brief Returns unused memory to the OS.
+ *
+ * Free memory is normally handed back gradually: large free heap blocks are
+ * purged once they have been unused for a few seconds, and cached mappings
+ * expire after a second. This function does all of it at once. It shrinks
+ * each arena's top chunk, purges every large free block and unmaps the
+ * cached mappings. It is meant to be called between batch jobs or after a
+ * traffic spike.
+ *
+ * Block headers stay in place, so purged memory is reused like any other
+ * free memory and is simply faulted back in.
+ *
+ * @return size_t Number of bytes released.
+ * @note It is thread-safe.
+ */
+size_t memtrim(void);
+
+/**
+ * @brief Starts the sampling heap profiler.
+ *
+ * About one allocation per `sample_interval` bytes allocated is sampled: its
+ * call stack is recorded and it is tracked until it is freed. The distance
+ * between samples is drawn at random, so large and small allocations are
+ * represented in proportion to their bytes. With the profiler off, the
+ * allocation and free paths only test one flag.
+ *
+ * @param sample_interval Mean bytes between samples, 0 for the default of 512 KiB.
+ * @return void
+ * @note It is thread-safe.
+ */
+void memprof_start(size_t sample_interval);
+
+/**
+ * @brief Stops the heap profiler and discards everything it recorded.
+ *
+ * @return void
+ * @note It is thread-safe.
+ */
+void memprof_stop(void);
+
+/**
+ * @brief Writes the current heap profile.
+ *
+ * The output is the text heap profile format of gperftools, which `pprof`
+ * reads directly (`pprof --text ./program heap.prof`). Each line gives the
+ * sampled live objects and bytes, then all sampled objects and bytes since
+ * profiling started, for one call stack. It ends with the process memory map
+ * so addresses can be turned into symbols.
+ *
+ * @param path File to write, or NULL for standard error.
+ * @return int 0 on success, -1 if the file cannot be written.
+ * @note It is thread-safe. Sampling pauses while the profile is written.
+ */
+int memprof_dump(const char* path);
+
+/**
+ * @brief Writes the heap profile whenever the process receives `signo`.
+ *
+ * The handler only flags the request. The profile is written by the next
+ * thread that allocates, so a process that is not allocating does not dump.
+ *
+ * @param signo Signal to handle, e.g. SIGUSR1.
+ * @param path File to write, or NULL for standard error.
+ * @return int 0 on success, -1 if the path is too long or the handler cannot be installed.
+ */
+int memprof_dump_on_signal(int signo, const char* path);
+
+/**
+ * @brief Starts recording every allocation call to a trace file.
+ *
+ * memalloc, defalloc, memalloc_aligned, memalloc_batch, memresize, memfree,
+ * memfree_sized and memfree_batch each append a `memtrace_event_t` to a
+ * buffer owned by the calling thread. The buffer is written out with one
+ * write() when it fills, so recording takes no lock. A forked child does not
+ * record.
+ *
+ * @param path File to write, replaced if it exists.
+ * @return int 0 on success, -1 if a trace is already being recorded or the file cannot be written.
+ * @note It is thread-safe.
+ */
+int memtrace_start(const char* path);
+
+/**
+ * @brief Stops recording and writes out every thread's remaining events.
+ *
+ * @return int 0 on success, -1 if nothing was being recorded or a write failed.
+ * @note It is thread-safe.
+ */
+int memtrace_stop(void);
+
+/**
+ * @brief Changes one of the allocator's tuning parameters.
+ *
+ * The new value applies to the allocations and frees that follow; memory
+ * already handed out is not moved. Setting MEMALLOPT_MMAP_THRESHOLD fixes the
+ * threshold, which otherwise rises as mmap'ed blocks are freed. Lowering
+ * MEMALLOPT_MMAP_CACHE_BYTES below what is cached unmaps the cache.
+ *
+ * @param param One of the MEMALLOPT_* parameters.
+ * @param value New value, within the range given for the parameter.
+ * @return int 0 on success, -1 if the parameter is unknown or the value out of range.
+ * @note It is thread-safe.
+ */
+int memallopt(int param, size_t value);
+
+/**
+ * @brief Reads the current value of a tuning parameter.
+ *
+ * @param param One of the MEMALLOPT_* parameters.
+ * @param value Receives the value.
+ * @return int 0 on success, -1 if the parameter is unknown.
+ */
+int memallopt_get(int param, size_t* value);
+
+/**
+ * @brief Creates a region for allocations that are all freed together.
+ *
+ * A region hands out memory by bumping a pointer through chunks of
+ * `chunk_size` bytes taken from `memalloc()`. Nothing in it is freed one
+ * object at a time: `memregion_reset()` and `memregion_release()` rewind
+ * the whole region, however much was allocated, and keep the chunks for
+ * reuse. Requests larger than a quarter of a chunk get a block of their own.
+ *
+ * @param chunk_size Size of each chunk in bytes, 0 for the default of 64 KiB.
+ * @return memregion_t* New region, or NULL if allocation fails.
+ * @note A region is not thread-safe; use one per thread or per request.
+ */
+memregion_t* memregion_create(size_t chunk_size);
 
+/**
+ * @brief Allocates `size` bytes from a region.
+ *
+ * The memory is 16-byte aligned and stays valid until the region is reset,
+ * released to a mark taken before this call, or destroyed. It must not be
+ * passed to `memfree()` or `memresize()`.
+ *
+ * @param r Region to allocate from.
+ * @param size Number of bytes to allocate.
+ * @return void* Pointer to the memory, or NULL if `size` is 0 or allocation fails.
+ */
+void* memregion_alloc(memregion_t* r, size_t size);
+
+/**
+ * @brief Records the current fill level of a region.
+ *
+ * @param r Region to mark.
+ * @return memregion_mark_t Mark to pass to `memregion_release()`.
+ */
+memregion_mark_t memregion_mark(memregion_t* r);
+
+/**
+ * @brief Frees everything allocated from a region since `mark` was taken.
+ *
+ * Marks nest: releasing to a mark invalidates every mark taken after it.
+ *
+ * @param r Region the mark was taken from.
+ * @param mark Mark returned by `memregion_mark()`.
+ * @return void
+ */
+void memregion_release(memregion_t* r, memregion_mark_t mark);
+
+/**
+ * @brief Frees everything allocated from a region, keeping its chunks.
+ *
+ * @param r Region to reset. Can be NULL (no operation).
+ * @return void
+ */
+void memregion_reset(memregion_t* r);
+
+/**
+ * @brief Frees a region and all of its memory.
+ *
+ * @param r Region to destroy. Can be NULL (no operation).
+ * @return void
+ */
+void memregion_destroy(memregion_t* r);
+
+/**
+ * @brief Creates a pool of objects of one size and alignment.
+ *
+ * Objects are carved side by side out of 64 KiB slabs taken from `memalloc()`,
+ * with no per-object header, rounding beyond `align` or free-list search.
+ * Returned objects are kept on a freelist threaded through them and handed
+ * out again first. With `MEMPOOL_THREAD_CACHE`, each thread also keeps a
+ * few free objects of its own, so most gets and puts take no lock.
+ *
+ * @param obj_size Size of each object in bytes.
+ * @param align Alignment of each object, a power of two; 0 for pointer alignment.
+ * @param flags 0 or `MEMPOOL_THREAD_CACHE`.
+ * @return mempool_t* New pool, or NULL if the arguments are invalid or allocation fails.
+ * @note It is thread-safe.
+ */
+mempool_t* mempool_create(size_t obj_size, size_t align, unsigned flags);
+
+/**
+ * @brief Takes an object from a pool.
+ *
+ * The object's contents are undefined. It must be given back with
+ * `mempool_put()`, never with `memfree()`.
+ *
+ * @param p Pool to take from.
+ * @return void* The object, or NULL if allocation fails.
+ * @note It is thread-safe.
+ */
+void* mempool_get(mempool_t* p);
+
+/**
+ * @brief Gives an object back to its pool.
+ *
+ * Any thread may give back an object taken by another.
+ *
+ * @param p Pool the object came from.
+ * @param obj Object to give back. Can be NULL (no operation).
+ * @return void
+ * @note It is thread-safe.
+ */
+void mempool_put(mempool_t* p, void* obj);
+
+/**
+ * @brief Frees a pool and every object it handed out.
+ *
+ * No thread may use the pool or its objects afterwards. Objects other threads
+ * hold in their caches are forgotten rather than returned.
+ *
+ * @param p Pool to destroy. Can be NULL (no operation).
+ * @return void
+ */
+void mempool_destroy(mempool_t* p);
+
+#endif // MEMORY_ALLOCATOR_H
@@ -0,0 +1,314 @@
+/* Object pools: many objects of one size and alignment, such as list nodes
+   or connection state.
+
+   A pool carves its objects out of slabs taken from memalloc, packed side by
+   side with no header of their own. Freed objects go on an intrusive freelist
+   threaded through the objects, so getting and putting one is a pop or a
+   push under the pool's lock.
+
+   A pool created with MEMPOOL_THREAD_CACHE also keeps a small list of its
+   objects in each thread that uses it, and get/put run without the lock
+   until that list runs empty or overflows. A thread has a few such caches
+   and a pool always uses the one its id maps to. The pool id tells whose
+   objects a cache holds: objects cached for a pool that has since been
+   destroyed are simply forgotten, since their slabs are gone. */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "memory_allocator.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define ALIGNMENT 16
+#define ROUND_UP(x,a) (((x) + ((a) - 1)) & ~((a) - 1))
+
+#define POOL_SLAB_SIZE 0x10000                      // slabs are 64 KiB, so they come from the heap
+#define POOL_SLAB_MIN_OBJECTS 8                     // a slab holds at least this many objects, however large
+#define POOL_CACHE_SLOTS 8                          // pools a thread can cache objects for at once
+#define POOL_CACHE_COUNT 64                         // objects kept per thread before half go back to the pool
+#define POOL_CACHE_REFILL 32                        // objects moved to an empty thread cache at once
+
+// slab header, the objects follow it
+typedef struct pool_slab {
+    struct pool_slab* next;
+} pool_slab;
+
+struct mempool_t {
+    pthread_mutex_t lock;
+    void* free_objs;                // objects handed back, linked through their first word
+    char* bump;                     // first object of the newest slab never handed out
+    char* bump_end;
+    pool_slab* slabs;               // every slab, freed by mempool_destroy
+    size_t obj_size;                // rounded up to the alignment
+    size_t align;
+    size_t slab_size;
+    uint64_t id;
+    unsigned flags;
+    struct mempool_t* prev;         // neighbours in live_pools
+    struct mempool_t* next;
+};
+
+// objects one thread holds for one pool
+typedef struct pool_cache {
+    uint64_t id;                    // pool the objects belong to, 0 if none
+    void* objs;
+    unsigned count;
+} pool_cache;
+
+static __thread pool_cache pool_caches[POOL_CACHE_SLOTS];
+static __thread bool pool_caches_registered;
+static pthread_key_t pool_cache_key;
+static pthread_once_t pool_cache_once = PTHREAD_ONCE_INIT;
+
+static atomic_uint_fast64_t next_pool_id = 1;
+static mempool_t* live_pools = NULL;        // pools with thread caches, so exiting threads can find them
+static pthread_mutex_t live_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//helper function to take one object, caller holds p->lock
+static void* pool_take(mempool_t* p)
+{
+
+    void* obj = p->free_objs;
+    if (obj) {
+        p->free_objs = *(void**)obj;
+        return obj;
+    }
+
+    if (p->bump == p->bump_end) {
+        pool_slab* sl = p->align > ALIGNMENT ? memalloc_aligned(p->slab_size, p->align)
+                                             : memalloc(p->slab_size);
+        if (!sl)
+            return NULL;
+        sl->next = p->slabs;
+        p->slabs = sl;
+        // objects are packed from the first aligned address after the header to the end of the block
+        p->bump = (char*)sl + ROUND_UP(sizeof(pool_slab), p->align);
+        size_t room = (size_t)((char*)sl + memusable_size(sl) - p->bump);
+        p->bump_end = p->bump + room / p->obj_size * p->obj_size;
+    }
+
+    obj = p->bump;
+    p->bump += p->obj_size;
+    return obj;
+
+}
+
+//helper function to give the chain `first`..`last` back to the pool, caller holds p->lock
+static void pool_give(mempool_t* p, void* first, void* last)
+{
+    *(void**)last = p->free_objs;
+    p->free_objs = first;
+}
+
+//helper function to return a thread cache's objects to their pool, if it still exists
+static void pool_cache_flush(pool_cache* c)
+{
+
+    if (c->objs) {
+        // the chain is only walked once the pool is known to be alive, a destroyed pool's slabs are gone
+        pthread_mutex_lock(&live_pools_lock);
+        for (mempool_t* p = live_pools; p; p = p->next) {
+            if (p->id == c->id) {
+                void* last = c->objs;
+                while (*(void**)last)
+                    last = *(void**)last;
+                pthread_mutex_lock(&p->lock);
+                pool_give(p, c->objs, last);
+                pthread_mutex_unlock(&p->lock);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&live_pools_lock);
+    }
+    c->id = 0;
+    c->objs = NULL;
+    c->count = 0;
+
+}
+
+// thread exit destructor: hand every cached object back
+static void pool_caches_drain(void* arg)
+{
+    (void)arg;
+    for (size_t i = 0; i < POOL_CACHE_SLOTS; i++)
+        pool_cache_flush(&pool_caches[i]);
+}
+
+static void pool_cache_create_key(void)
+{
+    pthread_key_create(&pool_cache_key, pool_caches_drain);
+}
+
+//helper function to get this thread's cache for `p`, taking the slot over from another pool if needed
+static pool_cache* pool_cache_for(mempool_t* p)
+{
+
+    pool_cache* c = &pool_caches[p->id % POOL_CACHE_SLOTS];
+    if (c->id == p->id)
+        return c;
+
+    if (!pool_caches_registered) {
+        pthread_once(&pool_cache_once, pool_cache_create_key);
+        pthread_setspecific(pool_cache_key, pool_caches);
+        pool_caches_registered = TRUE;
+    }
+    pool_cache_flush(c);
+    c->id = p->id;
+    return c;
+
+}
+
+mempool_t* mempool_create(size_t obj_size, size_t align, unsigned flags)
+{
+
+    // objects hold at least the freelist link and are aligned at least as well as it
+    if (align == 0)
+        align = sizeof(void*);
+    if (obj_size == 0 || (align & (align - 1)) || align < sizeof(void*))
+        return NULL;
+    // a slab of POOL_SLAB_MIN_OBJECTS rounded objects plus its header has to fit in a size_t
+    if (align > SIZE_MAX / 4 / POOL_SLAB_MIN_OBJECTS ||
+        obj_size > (SIZE_MAX - align) / POOL_SLAB_MIN_OBJECTS - align)
+        return NULL;
+
+    mempool_t* p = memalloc(sizeof(mempool_t));
+    if (!p)
+        return NULL;
+
+    if (obj_size < sizeof(void*))
+        obj_size = sizeof(void*);
+    p->obj_size = ROUND_UP(obj_size, align);
+    p->align = align;
+    p->slab_size = POOL_SLAB_SIZE;
+    if (p->slab_size < ROUND_UP(sizeof(pool_slab), align) + POOL_SLAB_MIN_OBJECTS * p->obj_size)
+        p->slab_size = ROUND_UP(sizeof(pool_slab), align) + POOL_SLAB_MIN_OBJECTS * p->obj_size;
+    p->free_objs = NULL;
+    p->bump = p->bump_end = NULL;
+    p->slabs = NULL;
+    p->id = atomic_fetch_add(&next_pool_id, 1);
+    p->flags = flags;
+    p->prev = p->next = NULL;
+    pthread_mutex_init(&p->lock, NULL);
+
+    if (flags & MEMPOOL_THREAD_CACHE) {
+        pthread_mutex_lock(&live_pools_lock);
+        p->next = live_pools;
+        if (live_pools)
+            live_pools->prev = p;
+        live_pools = p;
+        pthread_mutex_unlock(&live_pools_lock);
+    }
+    return p;
+
+}
+
+void* mempool_get(mempool_t* p)
+{
+
+    if (!p)
+        return NULL;
+
+    if (!(p->flags & MEMPOOL_THREAD_CACHE)) {
+        pthread_mutex_lock(&p->lock);
+        void* obj = pool_take(p);
+        pthread_mutex_unlock(&p->lock);
+        return obj;
+    }
+
+    pool_cache* c = pool_cache_for(p);
+    if (!c->objs) {
+        // refill with a batch, so the lock is taken once per POOL_CACHE_REFILL gets
+        pthread_mutex_lock(&p->lock);
+        while (c->count < POOL_CACHE_REFILL) {
+            void* obj = pool_take(p);
+            if (!obj)
+                break;
+            *(void**)obj = c->objs;
+            c->objs = obj;
+            c->count++;
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (!c->objs)
+            return NULL;
+    }
+
+    void* obj = c->objs;
+    c->objs = *(void**)obj;
+    c->count--;
+    return obj;
+
+}
+
+void mempool_put(mempool_t* p, void* obj)
+{
+
+    if (!p || !obj)
+        return;
+
+    if (!(p->flags & MEMPOOL_THREAD_CACHE)) {
+        pthread_mutex_lock(&p->lock);
+        pool_give(p, obj, obj);
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+
+    pool_cache* c = pool_cache_for(p);
+    if (c->count >= POOL_CACHE_COUNT) {
+        // the older half goes back, the most recently used objects stay
+        void* last_kept = c->objs;
+        for (unsigned i = 1; i < POOL_CACHE_COUNT / 2; i++)
+            last_kept = *(void**)last_kept;
+        void* first = *(void**)last_kept;
+        void* last = first;
+        while (*(void**)last)
+            last = *(void**)last;
+        *(void**)last_kept = NULL;
+        c->count = POOL_CACHE_COUNT / 2;
+        pthread_mutex_lock(&p->lock);
+        pool_give(p, first, last);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    *(void**)obj = c->objs;
+    c->objs = obj;
+    c->count++;
+
+}
+
+void mempool_destroy(mempool_t* p)
+{
+
+    if (!p)
+        return;
+
+    if (p->flags & MEMPOOL_THREAD_CACHE) {
+        pthread_mutex_lock(&live_pools_lock);
+        if (p->prev)
+            p->prev->next = p->next;
+        else
+            live_pools = p->next;
+        if (p->next)
+            p->next->prev = p->prev;
+        pthread_mutex_unlock(&live_pools_lock);
+
+        // this thread's cached objects are dropped now, other threads' when their slot is next reused
+        pool_cache* c = &pool_caches[p->id % POOL_CACHE_SLOTS];
+        if (c->id == p->id) {
+            c->id = 0;
+            c->objs = NULL;
+            c->count = 0;
+        }
+    }
+
+    pool_slab* sl = p->slabs;
+    while (sl) {
+        pool_slab* next = sl->next;
+        memfree(sl);
+        sl = next;
+    }
+    pthread_mutex_destroy(&p->lock);
+    memfree(p);
+
+}
@@ -0,0 +1,181 @@
+/* Regions: bump allocation for memory that all dies at the same time, such as
+   everything built while serving one request.
+
+   A region hands out memory from chunks obtained with memalloc. Allocating
+   is a bounds check and a pointer increment, and nothing is freed one object
+   at a time. memregion_reset rewinds the region to its first chunk, and
+   memregion_release rewinds it to an earlier mark. Both keep the chunks for
+   the allocations that follow, so they cost the same however much was
+   allocated. Requests too large to share a chunk get a block of their own,
+   which is freed when the region is rewound past it. */
+#include <stdint.h>
+#include "memory_allocator.h"
+
+#define ALIGNMENT 16
+#define ROUND_UP(x,a) (((x) + ((a) - 1)) & ~((a) - 1))
+
+#define REGION_CHUNK_SIZE 0x10000                   // default chunk size, small enough to come from the heap
+#define REGION_MIN_CHUNK 0x400                      // smaller chunk sizes are raised to this
+#define REGION_LARGE_FRACTION 4                     // requests above chunk_size / 4 get their own block
+
+// a chunk or large block; the memory handed out follows the header
+typedef struct region_chunk {
+    struct region_chunk* next;
+    char* end;
+} region_chunk;
+#define REGION_CHUNK_HEADER ROUND_UP(sizeof(region_chunk), ALIGNMENT)
+
+struct memregion_t {
+    char* pos;                  // next free byte in the current chunk
+    char* end;                  // end of the current chunk
+    region_chunk* current;      // chunk being bumped through, NULL before the first allocation
+    region_chunk* first;        // every chunk, in the order they are bumped through
+    region_chunk* large;        // blocks of oversized requests, newest first
+    size_t chunk_size;
+};
+
+memregion_t* memregion_create(size_t chunk_size)
+{
+
+    memregion_t* r = memalloc(sizeof(memregion_t));
+    if (!r)
+        return NULL;
+
+    if (chunk_size == 0)
+        chunk_size = REGION_CHUNK_SIZE;
+    if (chunk_size < REGION_MIN_CHUNK)
+        chunk_size = REGION_MIN_CHUNK;
+
+    r->pos = r->end = NULL;
+    r->current = r->first = r->large = NULL;
+    r->chunk_size = chunk_size;
+    return r;
+
+}
+
+//helper function to give an oversized request a block of its own
+static void* region_alloc_large(memregion_t* r, size_t size)
+{
+
+    region_chunk* c = memalloc(REGION_CHUNK_HEADER + size);
+    if (!c)
+        return NULL;
+    c->end = (char*)c + REGION_CHUNK_HEADER + size;
+    c->next = r->large;
+    r->large = c;
+    return (char*)c + REGION_CHUNK_HEADER;
+
+}
+
+//helper function to move on to the next chunk, reusing one left by a reset if there is one
+static void* region_alloc_slow(memregion_t* r, size_t size)
+{
+
+    if (size > r->chunk_size / REGION_LARGE_FRACTION)
+        return region_alloc_large(r, size);
+
+    region_chunk* next = r->current ? r->current->next : r->first;
+    if (!next) {
+        next = memalloc(r->chunk_size);
+        if (!next)
+            return NULL;
+        // the block may be a little larger than asked for, and all of it is ours
+        next->end = (char*)next + memusable_size(next);
+        next->next = NULL;
+        if (r->current)
+            r->current->next = next;
+        else
+            r->first = next;
+    }
+
+    r->current = next;
+    r->pos = (char*)next + REGION_CHUNK_HEADER + size;
+    r->end = next->end;
+    return (char*)next + REGION_CHUNK_HEADER;
+
+}
+
+void* memregion_alloc(memregion_t* r, size_t size)
+{
+
+    // the rounded size plus a chunk header has to fit in a size_t
+    if (!r || size == 0 || size > SIZE_MAX - REGION_CHUNK_HEADER - ALIGNMENT)
+        return NULL;
+
+    size = ROUND_UP(size, ALIGNMENT);
+    if ((size_t)(r->end - r->pos) >= size) {
+        void* p = r->pos;
+        r->pos += size;
+        return p;
+    }
+    return region_alloc_slow(r, size);
+
+}
+
+memregion_mark_t memregion_mark(memregion_t* r)
+{
+
+    memregion_mark_t mark = { NULL, NULL, NULL };
+    if (r) {
+        mark.chunk = r->current;
+        mark.pos = r->pos;
+        mark.large = r->large;
+    }
+    return mark;
+
+}
+
+//helper function to free the oversized blocks allocated since `keep` was the newest
+static void region_free_large(memregion_t* r, void* keep)
+{
+
+    while (r->large && r->large != keep) {
+        region_chunk* next = r->large->next;
+        memfree(r->large);
+        r->large = next;
+    }
+
+}
+
+void memregion_release(memregion_t* r, memregion_mark_t mark)
+{
+
+    if (!r)
+        return;
+
+    region_free_large(r, mark.large);
+    r->current = mark.chunk;
+    r->pos = mark.pos;
+    r->end = mark.chunk ? ((region_chunk*)mark.chunk)->end : NULL;
+
+}
+
+void memregion_reset(memregion_t* r)
+{
+
+    if (!r)
+        return;
+
+    // the chunks stay on the list and are bumped through again from the first one
+    region_free_large(r, NULL);
+    r->current = NULL;
+    r->pos = r->end = NULL;
+
+}
+
+void memregion_destroy(memregion_t* r)
+{
+
+    if (!r)
+        return;
+
+    region_free_large(r, NULL);
+    region_chunk* c = r->first;
+    while (c) {
+        region_chunk* next = c->next;
+        memfree(c);
+        c = next;
+    }
+    memfree(r);
+
+}
@@ -1,6 +1,54 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
 #include "memory_allocator.h"
 
+static mempool_t* doomed;
+static pthread_barrier_t pool_barrier;
+
+// caches objects of `doomed`, waits for it to be destroyed, then reuses its memory and either
+// touches every cache slot through new pools or just exits
+static void* pool_cache_user(void* arg) {
+    void* objs[16];
+    for (int i = 0; i < 16; i++)
+        objs[i] = mempool_get(doomed);
+    for (int i = 0; i < 16; i++)
+        mempool_put(doomed, objs[i]);
+    pthread_barrier_wait(&pool_barrier);
+    pthread_barrier_wait(&pool_barrier);
+
+    // the destroyed pool's slabs come back as blocks full of non-pointers
+    void* reuse[8];
+    for (int i = 0; i < 8; i++) {
+        reuse[i] = memalloc(0x10000);
+        if (reuse[i])
+            memset(reuse[i], 0xFF, memusable_size(reuse[i]));
+    }
+    if (arg) {
+        for (int i = 0; i < 8; i++) {
+            mempool_t* q = mempool_create(32, 0, MEMPOOL_THREAD_CACHE);
+            mempool_put(q, mempool_get(q));
+            mempool_destroy(q);
+        }
+    }
+    for (int i = 0; i < 8; i++)
+        memfree(reuse[i]);
+    return NULL;
+}
+
+// reads the summary line of a heap profile: live objects and bytes, all-time objects and bytes, interval
+static int read_profile(const char* path, size_t out[5]) {
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return -1;
+    int n = fscanf(f, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &out[0], &out[1], &out[2], &out[3], &out[4]);
+    fclose(f);
+    remove(path);
+    return n == 5 ? 0 : -1;
+}
+
 int main() {
     printf("Running basic allocation tests...\n");
 
@@ -17,6 +65,50 @@ int main() {
     a = memresize(a, sizeof(int));
     if (!a) return printf("FAIL: memresize shrink\n"), 1;
 
+    // the last heap block grows in place, into the top chunk and past it
+    memstats_t grow_before, grow_after;
+    char* last = memalloc(60000);
+    memstats(&grow_before);
+    last[59999] = 9;
+    if (memresize(last, 100000) != last || memresize(last, 120000) != last || last[59999] != 9)
+        return printf("FAIL: memresize into top chunk\n"), 1;
+    memstats(&grow_after);
+    if (grow_after.heap_size <= grow_before.heap_size)
+        return printf("FAIL: memresize past top chunk\n"), 1;
+    memfree(last);
+
+    // a block with a free left neighbour slides down into it
+    char* left = memalloc(2000);
+    char* mid = memalloc(2000);
+    char* right = memalloc(2000); // keeps the right neighbour allocated
+    for (int i = 0; i < 2000; i++)
+        mid[i] = (char)i;
+    memfree(left);
+    char* slid = memresize(mid, 3500);
+    if (!slid || slid >= mid)
+        return printf("FAIL: memresize into left neighbour\n"), 1;
+    for (int i = 0; i < 2000; i++) {
+        if (slid[i] != (char)i)
+            return printf("FAIL: memresize left neighbour contents\n"), 1;
+    }
+    memfree(slid);
+    memfree(right);
+
+    // a size that cannot fit fails and leaves the block alone, on the heap and on the mmap path
+    char* heap_resize = memalloc(1000);
+    char* huge_resize = memalloc(300000);
+    size_t heap_usable = memusable_size(heap_resize);
+    heap_resize[999] = 7;
+    if (memresize(heap_resize, SIZE_MAX) || memresize(heap_resize, SIZE_MAX - 8) || memresize(huge_resize, SIZE_MAX) ||
+        memresize(a, SIZE_MAX) || memusable_size(heap_resize) != heap_usable || heap_resize[999] != 7 || *a != 42)
+        return printf("FAIL: memresize overflow\n"), 1;
+    memfree(heap_resize);
+    memfree(huge_resize);
+
+    // sizes that leave no room for a header fail instead of wrapping
+    if (memalloc(SIZE_MAX - 40) || memalloc(SIZE_MAX))
+        return printf("FAIL: memalloc overflow\n"), 1;
+
     // calloc-like
     int* b = defalloc(5, sizeof(int));
     for (int i = 0; i < 5; i++) {
@@ -24,9 +116,237 @@ int main() {
             return printf("FAIL: defalloc not zeroed\n"), 1;
     }
 
+    // reused memory is cleared, fresh memory is zero without clearing
+    char* dirty = memalloc(5000);
+    for (int i = 0; i < 5000; i++)
+        dirty[i] = (char)0xFF;
+    memfree(dirty);
+    char* clean = defalloc(1000, 5);
+    char* big = defalloc(1, 1 << 22);
+    for (int i = 0; i < 5000; i++) {
+        if (clean[i] != 0 || big[i * 800] != 0)
+            return printf("FAIL: defalloc reused memory not zeroed\n"), 1;
+    }
+    memfree(clean);
+    memfree(big);
+
+    // memtrim hands a large free block's pages back, and the block still reads as zero when reused
+    char* trimmed = memalloc(100000);
+    char* guard = memalloc(100); // keeps the block off the top chunk
+    for (int i = 0; i < 100000; i++)
+        trimmed[i] = (char)0xFF;
+    memtrim(); // whatever else was trimmable goes first, so only the block's pages are left
+    memfree(trimmed);
+    if (memtrim() == 0)
+        return printf("FAIL: memtrim released nothing\n"), 1;
+    char* reused = defalloc(1, 100000);
+    if (reused != trimmed)
+        return printf("FAIL: memtrim range not reused\n"), 1;
+    for (int i = 0; i < 100000; i++) {
+        if (reused[i] != 0)
+            return printf("FAIL: memtrim range not zero\n"), 1;
+    }
+    memfree(reused);
+    memfree(guard);
+
+    // aligned, on the heap and on the mmap path
+    char* c = memalloc_aligned(100, 64);
+    char* d = memalloc_aligned(300000, 4096);
+    if (!c || ((uintptr_t)c & 63) || !d || ((uintptr_t)d & 4095))
+        return printf("FAIL: memalloc_aligned\n"), 1;
+    c = memresize(c, 1000);
+    if (!c) return printf("FAIL: memresize aligned\n"), 1;
+    char* huge = memalloc_aligned(100, (size_t)1 << 33);
+    if (!huge || ((uintptr_t)huge & (((size_t)1 << 33) - 1)) || memusable_size(huge) < 100)
+        return printf("FAIL: memalloc_aligned above 1 GiB\n"), 1;
+    huge[99] = 1;
+    memfree(huge);
+
+    // batch of same-size nodes
+    void* nodes[100];
+    if (memalloc_batch(48, 100, nodes) != 100)
+        return printf("FAIL: memalloc_batch\n"), 1;
+    for (int i = 0; i < 100; i++)
+        *(int*)nodes[i] = i;
+    memfree_batch(nodes, 100);
+    if (memalloc_batch(SIZE_MAX, 1, nodes) != 0 || memalloc_batch(SIZE_MAX - 8, 1, nodes) != 0)
+        return printf("FAIL: memalloc_batch overflow\n"), 1;
+
+    // usable size covers the request, sized free takes any size up to it
+    char* e = memalloc(20);
+    size_t usable = memusable_size(e);
+    if (usable < 20)
+        return printf("FAIL: memusable_size\n"), 1;
+    e[usable - 1] = 1;
+    memfree_sized(e, usable);
+
+    // a small block with a mapping of its own, as when its arena is full, never goes to the thread cache
+    void* small_mapped[100];
+    for (int i = 0; i < 100; i++) {
+        small_mapped[i] = memalloc_aligned(100, 1 << 20);
+        if (!small_mapped[i])
+            return printf("FAIL: memalloc_aligned small mapped\n"), 1;
+    }
+    for (int i = 0; i < 100; i++)
+        memfree_sized(small_mapped[i], 100);
+    memfree(memalloc(100));
+
+    // region: marks rewind part of it, reset rewinds all of it and reuses the chunks
+    memregion_t* r = memregion_create(4096);
+    char* first = memregion_alloc(r, 100);
+    memregion_mark_t mark = memregion_mark(r);
+    for (int i = 0; i < 1000; i++) {
+        char* o = memregion_alloc(r, 1 + i % 200);
+        if (!o || ((uintptr_t)o & 15))
+            return printf("FAIL: memregion_alloc\n"), 1;
+        o[0] = (char)i;
+    }
+    if (!memregion_alloc(r, 100000))
+        return printf("FAIL: memregion_alloc large\n"), 1;
+    if (memregion_alloc(r, SIZE_MAX - 3) || memregion_alloc(r, SIZE_MAX - 20))
+        return printf("FAIL: memregion_alloc overflow\n"), 1;
+    memregion_release(r, mark);
+    char* again = memregion_alloc(r, 100);
+    memregion_reset(r);
+    if (!first || again != first + 112 || memregion_alloc(r, 100) != first)
+        return printf("FAIL: memregion rewind\n"), 1;
+    memregion_destroy(r);
+
+    // pools pack objects at their own size and hand back the most recently returned one first
+    mempool_t* pool = mempool_create(24, 8, 0);
+    mempool_t* cached = mempool_create(40, 64, MEMPOOL_THREAD_CACHE);
+    char* o1 = mempool_get(pool);
+    char* o2 = mempool_get(pool);
+    if (!o1 || o2 != o1 + 24)
+        return printf("FAIL: mempool_get\n"), 1;
+    mempool_put(pool, o1);
+    if (mempool_get(pool) != o1)
+        return printf("FAIL: mempool_put\n"), 1;
+    void* objs[200];
+    for (int i = 0; i < 200; i++) {
+        objs[i] = mempool_get(cached);
+        if (!objs[i] || ((uintptr_t)objs[i] & 63))
+            return printf("FAIL: mempool_get cached\n"), 1;
+    }
+    for (int i = 0; i < 200; i++)
+        mempool_put(cached, objs[i]);
+    if (mempool_get(cached) != objs[199])
+        return printf("FAIL: mempool_put cached\n"), 1;
+    mempool_destroy(pool);
+    mempool_destroy(cached);
+    if (mempool_create(SIZE_MAX - 3, 8, 0) || mempool_create(SIZE_MAX / 8, 8, 0))
+        return printf("FAIL: mempool_create overflow\n"), 1;
+
+    // a pool destroyed while another thread caches its objects is forgotten by that thread
+    for (int touch = 0; touch < 2; touch++) {
+        pthread_t user;
+        doomed = mempool_create(48, 0, MEMPOOL_THREAD_CACHE);
+        pthread_barrier_init(&pool_barrier, NULL, 2);
+        pthread_create(&user, NULL, pool_cache_user, touch ? (void*)1 : NULL);
+        pthread_barrier_wait(&pool_barrier);
+        mempool_destroy(doomed);
+        pthread_barrier_wait(&pool_barrier);
+        pthread_join(user, NULL);
+        pthread_barrier_destroy(&pool_barrier);
+    }
+
+    // a trace holds the header and one event per call, in order
+    const char* trace_path = "/tmp/memalloc_test.trace";
+    if (memtrace_start(trace_path) != 0 || memtrace_start(trace_path) != -1)
+        return printf("FAIL: memtrace_start\n"), 1;
+    char* t = memalloc(100);
+    t = memresize(t, 5000);
+    memfree(t);
+    if (memtrace_stop() != 0)
+        return printf("FAIL: memtrace_stop\n"), 1;
+    FILE* tf = fopen(trace_path, "rb");
+    uint32_t header[2] = { 0, 0 };
+    memtrace_event_t ev[4];
+    size_t nev = 0;
+    if (tf && fread(header, sizeof(header), 1, tf) == 1)
+        nev = fread(ev, sizeof(memtrace_event_t), 4, tf);
+    if (tf)
+        fclose(tf);
+    remove(trace_path);
+    if (header[0] != MEMTRACE_MAGIC || nev != 3 || ev[0].op != MEMTRACE_ALLOC || ev[0].size != 100 ||
+        ev[1].op != MEMTRACE_RESIZE || ev[1].old_object != ev[0].object || ev[2].op != MEMTRACE_FREE ||
+        ev[2].object != ev[1].object)
+        return printf("FAIL: memtrace events\n"), 1;
+
+    // the profiler samples about one block per interval bytes, and a restart starts from nothing
+    const char* prof_path = "/tmp/memalloc_test.prof";
+    size_t hp[5];
+    void* sampled[4096];
+    memprof_start(4096);
+    for (int i = 0; i < 4096; i++)
+        sampled[i] = memalloc(256);
+    if (memprof_dump(prof_path) != 0 || read_profile(prof_path, hp) != 0 || hp[4] != 4096 ||
+        hp[0] < 128 || hp[0] > 512 || hp[1] != hp[0] * 256 || hp[2] != hp[0] || hp[3] != hp[1])
+        return printf("FAIL: memprof samples\n"), 1;
+    for (int i = 0; i < 2048; i++)
+        memfree(sampled[i]);
+    size_t all_time = hp[2];
+    if (memprof_dump(prof_path) != 0 || read_profile(prof_path, hp) != 0 || hp[0] >= all_time || hp[2] != all_time)
+        return printf("FAIL: memprof frees\n"), 1;
+    memprof_stop();
+    memprof_start(4096);
+    for (int i = 2048; i < 4096; i++)
+        memfree(sampled[i]);
+    if (memprof_dump(prof_path) != 0 || read_profile(prof_path, hp) != 0 || hp[0] || hp[1] || hp[2] || hp[3])
+        return printf("FAIL: memprof restart kept old samples\n"), 1;
+    if (memprof_dump_on_signal(SIGUSR1, prof_path) != 0)
+        return printf("FAIL: memprof_dump_on_signal\n"), 1;
+    raise(SIGUSR1);
+    memfree(memalloc(64)); // the next allocation writes the profile
+    if (read_profile(prof_path, hp) != 0)
+        return printf("FAIL: memprof signalled dump\n"), 1;
+    signal(SIGUSR1, SIG_DFL);
+    memprof_stop();
+
+    // tuning values are checked, read back, and take effect
+    size_t v = 0;
+    if (memallopt(MEMALLOPT_GROW_SIZE, 0x3000) != -1 || memallopt(MEMALLOPT_FIT, 3) != -1 ||
+        memallopt(0, 1) != -1 || memallopt_get(0, &v) != -1)
+        return printf("FAIL: memallopt accepted a bad value\n"), 1;
+    if (memallopt(MEMALLOPT_MMAP_THRESHOLD, 0x10000) != 0 || memallopt_get(MEMALLOPT_MMAP_THRESHOLD, &v) != 0 ||
+        v != 0x10000 || memallopt(MEMALLOPT_FIT, MEMALLOPT_FIT_ADDRESS) != 0 ||
+        memallopt_get(MEMALLOPT_FIT, &v) != 0 || v != MEMALLOPT_FIT_ADDRESS)
+        return printf("FAIL: memallopt\n"), 1;
+    memstats_t before, after;
+    memstats(&before);
+    char* mapped = memalloc(0x10000);
+    memstats(&after);
+    if (!mapped || after.mmap_count != before.mmap_count + 1)
+        return printf("FAIL: memallopt mmap threshold\n"), 1;
+    memfree(mapped);
+    memallopt(MEMALLOPT_FIT, MEMALLOPT_FIT_FIFO);
+
+    // statistics see this thread's allocations
+    memstats_t st;
+    memstats(&st);
+    if (st.bytes_requested == 0 || st.heap_size == 0 || st.heap_peak < st.heap_size || memstats_dump(NULL, 0, 1) == 0)
+        return printf("FAIL: memstats\n"), 1;
+
     // free
     memfree(a);
     memfree(b);
+    memfree(c);
+    memfree(d);
+
+    // every block is counted at the same size when it is allocated, resized and freed
+    char* g = memalloc(40);
+    memfree_sized(g, 40);
+    g = memalloc(20);
+    g = memresize(g, 600);
+    g = memresize(g, 100);
+    g = memresize(g, 200000);
+    g = memresize(g, 400000);
+    memfree(g);
+    memstats(&st);
+    for (int i = 0; i < MEMSTATS_CLASSES; i++) {
+        if (st.alloc_count[i] != st.free_count[i])
+            return printf("FAIL: memstats class %d does not balance\n", i), 1;
+    }
 
     printf("PASS: basic tests passed\n");
     return 0;
@@ -7,6 +7,9 @@ int main() {
     printf("Testing mmap allocation...\n");
 
 
+    size_t before = 0, after = 0;
+    memallopt_get(MEMALLOPT_MMAP_THRESHOLD, &before);
+
     void* p = memalloc(BIG_SIZE);
     if (!p) return printf("FAIL: mmap allocation failed\n"), 1;
 
@@ -14,6 +17,22 @@ int main() {
 
     memfree(p);
 
+    // freeing the mapping raises the threshold past it and parks the mapping in the cache
+    memstats_t st;
+    memallopt_get(MEMALLOPT_MMAP_THRESHOLD, &after);
+    memstats(&st);
+    if (after <= before || after < BIG_SIZE || st.mmap_cached_bytes < after)
+        return printf("FAIL: mmap threshold did not rise\n"), 1;
+
+    // the same size now comes from the heap, and a request that still reaches the mmap path reuses the cached mapping
+    void* heap = memalloc(BIG_SIZE);
+    void* again = memalloc(after - 16); // fills the cached mapping after its 16-byte header
+    memstats(&st);
+    if (!heap || again != p || st.mmap_count != 1 || st.mmap_cached_bytes != 0)
+        return printf("FAIL: mmap cache not reused\n"), 1;
+    memfree(heap);
+    memfree(again);
+
     printf("PASS: mmap test OK\n");
     return 0;
 
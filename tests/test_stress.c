@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "memory_allocator.h"
 
@@ -8,23 +9,34 @@
 int main() {
     printf("Stress testing allocator...\n");
 
-    void* ptrs[N];
+    void* ptrs[N] = { 0 };
+    size_t sizes[N];
     srand(1234);
 
     // random alloc/free
-    for (int i = 0; i < 10; i++) {
+    for (int i = 0; i < N; i++) {
         size_t s = rand() % 2048 + 1;
         ptrs[i] = memalloc(s);
         if (!ptrs[i]) {
             return printf("FAIL: memalloc returned NULL\n"), 1;
         }
-        printf("Alloc %d: %p, size %zu\n", i, ptrs[i], s);
+        sizes[i] = s;
+        memset(ptrs[i], i & 0xff, s);
         if (rand() % 3 == 0) {
             memfree(ptrs[i]);
             ptrs[i] = NULL;
         }
     }
 
+    // survivors must be untouched by later allocations
+    for (int i = 0; i < N; i++) {
+        if (!ptrs[i])
+            continue;
+        unsigned char* p = ptrs[i];
+        if (p[0] != (i & 0xff) || p[sizes[i] - 1] != (i & 0xff))
+            return printf("FAIL: block %d corrupted\n", i), 1;
+    }
+
     // free remaining
     for (int i = 0; i < N; i++) {
         memfree(ptrs[i]);
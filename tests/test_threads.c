@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include "memory_allocator.h"
+
+#define THREADS 4
+#define ROUNDS 20000
+#define LIVE 64
+
+#define PAIRS 2                 // producer/consumer pairs
+#define HANDED 100000           // blocks each producer hands over
+#define RING 1024               // blocks in flight per pair
+#define PAUSE_EVERY 4096        // a producer stops allocating until its ring is empty this often
+
+static void* handoff[THREADS][LIVE];
+
+// one producer allocates and fills blocks, one consumer checks and frees them while the producer carries on
+typedef struct handover {
+    struct { unsigned char* p; size_t size; } ring[RING];
+    _Atomic size_t head;        // next slot the producer fills
+    _Atomic size_t tail;        // next slot the consumer empties
+} handover;
+
+static handover pairs[PAIRS];
+
+static void* worker(void* arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned char* live[LIVE] = {0};
+
+    for (int r = 0; r < ROUNDS; r++) {
+        int slot = r % LIVE;
+        if (live[slot]) {
+            size_t n = (size_t)(slot * 13 % 500) + 1;
+            for (size_t i = 0; i < n; i++) {
+                if (live[slot][i] != (unsigned char)(id + slot))
+                    return (void*)1;
+            }
+            memfree(live[slot]);
+        }
+        size_t n = (size_t)(slot * 13 % 500) + 1;
+        live[slot] = memalloc(n);
+        if (!live[slot])
+            return (void*)1;
+        for (size_t i = 0; i < n; i++)
+            live[slot][i] = (unsigned char)(id + slot);
+    }
+
+    // leave half the blocks for another thread to free
+    for (int i = 0; i < LIVE; i++) {
+        if (i % 2) handoff[id][i] = live[i];
+        else memfree(live[i]);
+    }
+    return NULL;
+}
+
+static void* producer(void* arg) {
+    handover* h = arg;
+    for (size_t i = 0; i < HANDED; i++) {
+        size_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&h->tail, memory_order_acquire) == RING)
+            sched_yield();
+        // sizes on both sides of the thread cache limit, so frees go through the cache and straight to the arena
+        size_t size = 16 + i * 37 % 3000;
+        unsigned char* p = memalloc(size);
+        if (!p)
+            return (void*)1;
+        memset(p, (int)(i & 0xFF), size);
+        h->ring[head % RING].p = p;
+        h->ring[head % RING].size = size;
+        atomic_store_explicit(&h->head, head + 1, memory_order_release);
+
+        // an owner that stops allocating leaves the draining to the threads freeing into its arena
+        if (i % PAUSE_EVERY == PAUSE_EVERY - 1) {
+            while (atomic_load_explicit(&h->tail, memory_order_acquire) != head + 1)
+                sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    handover* h = arg;
+    for (size_t i = 0; i < HANDED; i++) {
+        size_t tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+        while (atomic_load_explicit(&h->head, memory_order_acquire) == tail)
+            sched_yield();
+        unsigned char* p = h->ring[tail % RING].p;
+        size_t size = h->ring[tail % RING].size;
+        for (size_t j = 0; j < size; j++) {
+            if (p[j] != (unsigned char)(i & 0xFF))
+                return (void*)1;
+        }
+        if (i % 2)
+            memfree(p);
+        else
+            memfree_sized(p, size);
+        atomic_store_explicit(&h->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+int main() {
+    printf("Testing concurrent allocation...\n");
+
+    pthread_t t[THREADS];
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&t[i], NULL, worker, (void*)(intptr_t)i);
+
+    for (int i = 0; i < THREADS; i++) {
+        void* res;
+        pthread_join(t[i], &res);
+        if (res) return printf("FAIL: thread %d saw corrupted data\n", i), 1;
+    }
+
+    // cross-thread frees after the owners have exited and drained their caches
+    for (int i = 0; i < THREADS; i++)
+        for (int j = 0; j < LIVE; j++)
+            memfree(handoff[i][j]);
+
+    void* p = memalloc(100);
+    if (!p) return printf("FAIL: memalloc after thread exit\n"), 1;
+    memfree(p);
+
+    // cross-thread frees while the owners are alive and allocating
+    pthread_t prod[PAIRS], cons[PAIRS];
+    for (int i = 0; i < PAIRS; i++) {
+        pthread_create(&prod[i], NULL, producer, &pairs[i]);
+        pthread_create(&cons[i], NULL, consumer, &pairs[i]);
+    }
+    for (int i = 0; i < PAIRS; i++) {
+        void* pres;
+        void* cres;
+        pthread_join(prod[i], &pres);
+        pthread_join(cons[i], &cres);
+        if (pres) return printf("FAIL: producer %d could not allocate\n", i), 1;
+        if (cres) return printf("FAIL: consumer %d saw corrupted data\n", i), 1;
+    }
+
+    printf("PASS: thread test passed\n");
+    return 0;
+}